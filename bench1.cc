@@ -0,0 +1,60 @@
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+#include "bptree_frozen.hh"
+#include "bptest.hh"
+
+/* point lookups on a tree larger than the last level cache:
+ * one descent at a time vs interleaved find_many vs the frozen layout
+*/
+
+int main(int argc, char* argv[]) {
+	long n = (argc > 1) ? atol(argv[1]) : 20000000;
+	long q = (argc > 2) ? atol(argv[2]) : 5000000;
+	bptree<long, long> bt(64);
+	unsigned seed = 1;
+
+	for (long i = 0; i < n; i++) {
+		long k = (long)rand_r(&seed) * RAND_MAX + rand_r(&seed);
+		bt.insert_key(k % (n * 4), i);
+	}
+	bt.dump_brief();
+
+	std::vector<long> keys(q);
+	std::vector<long*> values(q);
+	for (long i = 0; i < q; i++)
+		keys[i] = ((long)rand_r(&seed) * RAND_MAX + rand_r(&seed)) % (n * 4);
+
+	long found = 0;
+	double t0 = now();
+	for (long i = 0; i < q; i++) {
+		long* v;
+		found += bt.find_key(keys[i], v);
+	}
+	double t1 = now();
+	std::cout << "find_key:     " << (long)(q / (t1 - t0)) << " lookups/s, found "
+		<< found << std::endl;
+
+	t0 = now();
+	found = bt.find_many(keys.data(), values.data(), q);
+	t1 = now();
+	std::cout << "find_many<16>: " << (long)(q / (t1 - t0)) << " lookups/s, found "
+		<< found << std::endl;
+
+	t0 = now();
+	found = bt.find_many<32>(keys.data(), values.data(), q);
+	t1 = now();
+	std::cout << "find_many<32>: " << (long)(q / (t1 - t0)) << " lookups/s, found "
+		<< found << std::endl;
+
+	bptree_frozen<long, long> fr = bt.freeze();
+	found = 0;
+	t0 = now();
+	for (long i = 0; i < q; i++) {
+		const long* v;
+		found += fr.find_key(keys[i], v);
+	}
+	t1 = now();
+	std::cout << "frozen:       " << (long)(q / (t1 - t0)) << " lookups/s, found "
+		<< found << ", " << fr.get_memory() / n << " bytes/key" << std::endl;
+}
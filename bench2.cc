@@ -0,0 +1,50 @@
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+#include <malloc.h>
+#include "bptree.hh"
+#include "bptest.hh"
+
+/* dense integer keys: heap bytes per entry and lookup rate with plain and
+ * frame-of-reference packed leaves
+*/
+
+static void run(long n, long q, bool compress) {
+	size_t before = mallinfo2().uordblks;
+	bptree<int, long>* bt = new bptree<int, long>(128, compress);
+	unsigned seed = 1;
+
+	for (long i = 0; i < n; i++) {
+		int k = (double)rand_r(&seed) / RAND_MAX * n;
+		bt->insert_key(k, i);
+	}
+	size_t bytes = mallinfo2().uordblks - before;
+
+	std::vector<int> keys(q);
+	std::vector<long*> values(q);
+	for (long i = 0; i < q; i++)
+		keys[i] = (double)rand_r(&seed) / RAND_MAX * n;
+
+	long found = 0;
+	double t0 = now();
+	for (long i = 0; i < q; i++) {
+		long* v;
+		found += bt->find_key(keys[i], v);
+	}
+	double t1 = now();
+	bt->find_many(keys.data(), values.data(), q);
+	double t2 = now();
+
+	std::cout << (compress ? "packed: " : "plain:  ") << bt->get_count()
+		<< " entries, " << (double)bytes / bt->get_count() << " bytes/entry, "
+		<< "find_key " << (long)(q / (t1 - t0)) << "/s, find_many "
+		<< (long)(q / (t2 - t1)) << "/s, found " << found << std::endl;
+	delete bt;
+}
+
+int main(int argc, char* argv[]) {
+	long n = (argc > 1) ? atol(argv[1]) : 10000000;
+	long q = (argc > 2) ? atol(argv[2]) : 2000000;
+	run(n, q, false);
+	run(n, q, true);
+}
@@ -0,0 +1,58 @@
+#include <iostream>
+#include <cstdlib>
+#include <sys/resource.h>
+#include "bptree.hh"
+#include "bptest.hh"
+
+/* grow one tree to n entries (default 2^30) and report, at every doubling,
+ * insert cost over the last interval, lookup rate and resident bytes per
+ * entry. pass a smaller n on boxes without ~40GB of memory
+*/
+
+static long max_rss() {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss * 1024L;
+}
+
+/* 64 bit mix of i, keys are unique and in random order */
+static uint64_t mix(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+int main(int argc, char* argv[]) {
+	uint64_t n = (argc > 1) ? atol(argv[1]) : (1UL << 30);
+	int m = (argc > 2) ? atoi(argv[2]) : 256;
+	bptree<uint64_t, uint32_t> bt(m);
+	uint64_t i = 0, mark = 1 << 20;
+	long rss0 = max_rss();
+	double t0 = now();
+
+	while (i < n) {
+		uint64_t start = i;
+		for (; i < mark && i < n; i++)
+			bt.insert_key(mix(i), (uint32_t)i);
+		double t1 = now();
+
+		uint64_t q = 1000000, found = 0;
+		for (uint64_t j = 0; j < q; j++) {
+			uint32_t* v;
+			found += bt.find_key(mix((j * 7919) % i), v);
+		}
+		double t2 = now();
+
+		std::cout << "count " << bt.get_count() << " depth " << bt.get_depth()
+			<< ": insert " << (t1 - t0) * 1e9 / (i - start)
+			<< " ns/op, lookup " << (t2 - t1) * 1e9 / q << " ns/op ("
+			<< found << " found), rss " << (double)(max_rss() - rss0) / i
+			<< " bytes/entry" << std::endl;
+		mark *= 2;
+		t0 = now();
+	}
+	bt.check();
+}
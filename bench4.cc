@@ -0,0 +1,50 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "bptree.hh"
+#include "bptest.hh"
+
+/* string keys with a long shared prefix: plain std::string keys against
+ * bpstr_key, whose 8 byte normalized prefix settles most comparisons
+*/
+
+template <typename K>
+static void run(const char* what, const std::vector<std::string>& strs,
+			const std::vector<std::string>& probes) {
+	bptree<K, long> bt(64);
+	std::vector<K> keys(probes.begin(), probes.end());
+
+	double t0 = now();
+	for (size_t i = 0; i < strs.size(); i++)
+		bt.insert_key(K(strs[i]), i);
+	double t1 = now();
+
+	long found = 0, *v;
+	for (auto &k : keys)
+		found += bt.find_key(k, v);
+	double t2 = now();
+
+	std::cout << what << ": insert " << (t1 - t0) * 1e9 / strs.size()
+		<< " ns/op, lookup " << (t2 - t1) * 1e9 / keys.size()
+		<< " ns/op, found " << found << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	long n = (argc > 1) ? atol(argv[1]) : 2000000;
+	std::vector<std::string> strs, probes;
+	unsigned seed = 1;
+	char buf[64];
+
+	for (long i = 0; i < n; i++) {
+		snprintf(buf, sizeof(buf), "%08x/user/session/%d",
+			rand_r(&seed), rand_r(&seed) % 1000);
+		strs.push_back(buf);
+	}
+	for (long i = 0; i < n; i++)
+		probes.push_back(strs[rand_r(&seed) % n]);
+
+	run<std::string>("std::string", strs, probes);
+	run<bpstr_key>("bpstr_key  ", strs, probes);
+}
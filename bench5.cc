@@ -0,0 +1,33 @@
+#include <iostream>
+#include <cstdlib>
+#include "bptree.hh"
+#include "bptest.hh"
+
+/* random inserts into a tree larger than the last level cache: direct
+ * writes vs writes parked in inner node buffers
+*/
+
+static void run(long n, size_t cap) {
+	bptree<long, long> bt(64);
+	unsigned seed = 1;
+
+	bt.set_write_buffer(cap);
+	double t0 = now();
+	for (long i = 0; i < n; i++) {
+		long k = (long)rand_r(&seed) * RAND_MAX + rand_r(&seed);
+		bt.insert_key(k % (n * 4), i);
+	}
+	double t1 = now();
+	bt.flush();
+	double t2 = now();
+	std::cout << "buffer " << cap << ": " << (long)(n / (t1 - t0)) << " inserts/s, "
+		<< (long)(n / (t2 - t0)) << " with final flush, count "
+		<< bt.get_count() << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	long n = (argc > 1) ? atol(argv[1]) : 20000000;
+	size_t caps[] = { 0, 64, 256, 1024 };
+	for (int i = 0; i < sizeof(caps) / sizeof(size_t); i++)
+		run(n, caps[i]);
+}
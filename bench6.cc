@@ -0,0 +1,56 @@
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+#include "bptree.hh"
+#include "bptest.hh"
+
+/* random lookup latency on the same tree built on the heap, in 4 KiB
+ * page regions and in hugepage regions
+*/
+
+static void run(const char* name, bpnode_memory* mem, long n, long q) {
+	bptree<long, long> bt(64);
+	unsigned seed = 1;
+
+	bt.set_memory(mem);
+	for (long i = 0; i < n; i++) {
+		long k = (long)rand_r(&seed) * RAND_MAX + rand_r(&seed);
+		bt.insert_key(k % (n * 4), i);
+	}
+
+	std::vector<long> keys(q);
+	for (long i = 0; i < q; i++)
+		keys[i] = ((long)rand_r(&seed) * RAND_MAX + rand_r(&seed)) % (n * 4);
+
+	long found = 0;
+	double t0 = now();
+	for (long i = 0; i < q; i++) {
+		long* v;
+		found += bt.find_key(keys[i], v);
+	}
+	double t1 = now();
+	std::cout << name << ": " << (t1 - t0) * 1e9 / q << " ns/lookup, found "
+		<< found;
+	if (mem != nullptr) {
+		bpmem_stats st = mem->get_stats();
+		std::cout << ", " << (st.reserved >> 20) << " MiB in " << st.regions
+			<< " regions, " << (st.huge >> 20) << " MiB huge, "
+			<< st.pages << " pages";
+	}
+	std::cout << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	long n = (argc > 1) ? atol(argv[1]) : 20000000;
+	long q = (argc > 2) ? atol(argv[2]) : 5000000;
+
+	run("heap", nullptr, n, q);
+	{
+		bpnode_memory mem(false);
+		run("4k regions", &mem, n, q);
+	}
+	{
+		bpnode_memory mem(true);
+		run("hugepages", &mem, n, q);
+	}
+}
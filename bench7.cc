@@ -0,0 +1,52 @@
+#include <iostream>
+#include <cstdlib>
+#include <string>
+#include "bptree_arena.hh"
+#include "bptest.hh"
+
+/* string values kept in the leaves vs out of line in a value arena:
+ * random inserts (which split leaves) and a full range scan, before and
+ * after the arena is compacted into key order
+*/
+
+template <typename T>
+static void scan(const char* name, T& bt, long n) {
+	size_t bytes = 0;
+	double t0 = now();
+	bt.scan_range(0, n * 4, [&](const long& k, const std::string& s) {
+		bytes += s.size();
+		return true;
+	});
+	double t1 = now();
+	std::cout << name << ": scan " << (long)(bt.get_count() / (t1 - t0))
+		<< " keys/s, " << bytes << " value bytes" << std::endl;
+}
+
+template <typename T>
+static void run(const char* name, T& bt, long n) {
+	std::string v(40, 'x');
+	unsigned seed = 1;
+
+	double t0 = now();
+	for (long i = 0; i < n; i++) {
+		long k = (long)rand_r(&seed) * RAND_MAX + rand_r(&seed);
+		bt.insert_key(k % (n * 4), v);
+	}
+	double t1 = now();
+	std::cout << name << ": " << (long)(n / (t1 - t0)) << " inserts/s" << std::endl;
+	scan(name, bt, n);
+}
+
+int main(int argc, char* argv[]) {
+	long n = (argc > 1) ? atol(argv[1]) : 5000000;
+	{
+		bptree<long, std::string> bt(64);
+		run("in leaves", bt, n);
+	}
+	{
+		bptree_arena<long, std::string> bt(64);
+		run("value arena", bt, n);
+		bt.compact();
+		scan("value arena compacted", bt, n);
+	}
+}
@@ -0,0 +1,85 @@
+/*
+ * Helpers shared by the tests and benchmarks
+ *
+ * Trees are checked against a std::map (or std::multimap) holding the same
+ * pairs: an in-order walk has to match it pair for pair, lookups have to
+ * agree with it on hits and misses. Every failure prints what was being
+ * checked and ends the process.
+*/
+#ifndef BPTEST_HH___
+#define BPTEST_HH___
+
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+#include <sys/time.h>
+
+/* wall clock in seconds */
+inline double now() {
+	struct timeval tv;
+	gettimeofday(&tv, nullptr);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* scan(fn) has to call fn(key, value) for exactly the pairs of ref, in
+ * order, and stop when fn returns false. keys are compared with ref's
+ * own comparator
+*/
+template <typename M, typename S>
+bool same_pairs(const M& ref, S scan) {
+	auto it = ref.begin();
+	auto less = ref.key_comp();
+	bool ok = scan([&](const typename M::key_type& k,
+				const typename M::mapped_type& v) {
+		if (it == ref.end() || less(it->first, k) || less(k, it->first) ||
+				!(it->second == v))
+			return false;
+		it++;
+		return true;
+	});
+	return ok && it == ref.end();
+}
+
+/* t holds exactly the pairs of ref and passes its structure check */
+template <typename T, typename M>
+void verify_scan(const char* what, const T& t, const M& ref) {
+	bool ok = same_pairs(ref, [&](auto fn) { return t.scan_all(fn); });
+	if (!ok || t.get_count() != ref.size()) {
+		std::cout << what << " err: count " << t.get_count() << " expect "
+			<< ref.size() << std::endl;
+		exit(-1);
+	}
+	t.check();
+}
+
+/* find_key and find_many agree with ref on every key in keys, present or
+ * not
+*/
+template <typename T, typename M>
+void verify_lookups(const char* what, const T& t, const M& ref,
+		const std::vector<typename M::key_type>& keys) {
+	typedef typename M::mapped_type V;
+	std::vector<V*> values(keys.size());
+	size_t found = t.find_many(keys.data(), values.data(), keys.size());
+
+	for (size_t i = 0; i < keys.size(); i++) {
+		auto r = ref.find(keys[i]);
+		bool in = r != ref.end();
+		V* v;
+		bool hit = t.find_key(keys[i], v);
+		if (hit != in || (hit && !(*v == r->second)) ||
+				(values[i] != nullptr) != in ||
+				(values[i] != nullptr && !(*values[i] == r->second))) {
+			std::cout << what << " err: lookup " << i << " of "
+				<< keys.size() << std::endl;
+			exit(-2);
+		}
+		found -= in;
+	}
+	if (found != 0) {
+		std::cout << what << " err: find_many count" << std::endl;
+		exit(-2);
+	}
+}
+
+#endif
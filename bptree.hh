@@ -9,8 +9,21 @@
 #include <cstdint>
 #include <climits>
 #include <vector>
+#include <string>
+#include <functional>
 #include <iostream>
 #include <cassert>
+#include <utility>
+#include <type_traits>
+#include <iterator>
+#include <algorithm>
+#include "bptree_memory.hh"
+
+#if defined(__GNUC__)
+#define BPTREE_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define BPTREE_PREFETCH(p) ((void)(p))
+#endif
 
 enum bpnode_type : uint8_t {
 	NODE_NONE = 0,
@@ -18,39 +31,193 @@ enum bpnode_type : uint8_t {
 	NODE_INNER = 0x2,
 };
 
-template <typename K, typename V> class bptree;
+template <typename K, typename V, typename C = std::less<K>> class bptree;
+template <typename K, typename V, typename C = std::less<K>> class bptree_frozen;
+
+/* invariant check callback, gets one message per problem found */
+typedef std::function<void(const std::string&)> bpreport;
+
+/* string key that keeps its first 8 bytes as a big-endian integer next to
+ * the string, so most comparisons are one integer compare and the string
+ * is only read on ties
+*/
+struct bpstr_key {
+	uint64_t prefix;
+	std::string str;
+
+	bpstr_key() : prefix{0} {}
+	bpstr_key(const std::string& s) : prefix{make_prefix(s)}, str{s} {}
+	bpstr_key(const char* s) : bpstr_key(std::string(s)) {}
+
+	static uint64_t make_prefix(const std::string& s) noexcept {
+		uint64_t p = 0;
+		for (size_t i = 0; i < 8; i++)
+			p = (p << 8) | (i < s.size() ? (unsigned char)s[i] : 0);
+		return p;
+	}
+};
+
+inline bool operator<(const bpstr_key& a, const bpstr_key& b) noexcept {
+	if (a.prefix != b.prefix)
+		return a.prefix < b.prefix;
+	/* equal prefix: a short string is the other one's prefix + zeros */
+	if (a.str.size() <= 8 || b.str.size() <= 8)
+		return a.str.size() < b.str.size();
+	return a.str.compare(8, std::string::npos, b.str, 8, std::string::npos) < 0;
+}
+
+inline bool operator==(const bpstr_key& a, const bpstr_key& b) noexcept {
+	return a.prefix == b.prefix && a.str == b.str;
+}
+
+inline std::ostream& operator<<(std::ostream& os, const bpstr_key& k) {
+	return os << k.str;
+}
+
+/* separator(left, right) gives a key s with left < s <= right to put in
+ * an inner node between two leaves. strings keep the shortest prefix of
+ * right that still sorts after left
+*/
+template <typename K>
+struct bpkey_traits {
+	static K separator(const K& left, const K& right) { return right; }
+};
+
+template <>
+struct bpkey_traits<std::string> {
+	static std::string separator(const std::string& left, const std::string& right) {
+		size_t i = 0;
+		while (i < left.size() && i < right.size() && left[i] == right[i])
+			i++;
+		return right.substr(0, i + 1);
+	}
+};
+
+template <>
+struct bpkey_traits<bpstr_key> {
+	static bpstr_key separator(const bpstr_key& left, const bpstr_key& right) {
+		return bpstr_key(bpkey_traits<std::string>::separator(left.str, right.str));
+	}
+};
+
+/* frame-of-reference leaf key encoding for integral keys, every key of a
+ * leaf is stored as a 1, 2 or 4 byte offset from the smallest one. the
+ * generic version never packs
+*/
+template <typename K, bool = std::is_integral<K>::value &&
+		!std::is_same<K, bool>::value>
+struct bpkey_codec {
+	static uint8_t pack(const bpvec<K>& keys, bpvec<uint8_t>& out,
+			uint64_t& base) noexcept { return 0; }
+	static K get(const uint8_t* p, uint64_t base, uint8_t width,
+			int i) noexcept { return K(); }
+	static int lower_index(const uint8_t* p, uint64_t base, uint8_t width,
+			int n, const K& key) noexcept { return 0; }
+};
+
+template <typename K>
+struct bpkey_codec<K, true> {
+	typedef typename std::make_unsigned<K>::type U;
+
+	static uint8_t pack(const bpvec<K>& keys, bpvec<uint8_t>& out,
+			uint64_t& base) noexcept {
+		if (keys.empty())
+			return 0;
+		uint64_t span = (U)keys.back() - (U)keys.front();
+		uint8_t width = span <= 0xff ? 1 : span <= 0xffff ? 2 :
+				span <= 0xffffffffULL ? 4 : 8;
+		if (width >= sizeof(K))
+			return 0;
+
+		base = (U)keys.front();
+		out.resize(keys.size() * width);
+		switch (width) {
+		case 1: put<uint8_t>(keys, out, base); break;
+		case 2: put<uint16_t>(keys, out, base); break;
+		default: put<uint32_t>(keys, out, base); break;
+		}
+		return width;
+	}
+
+	static K get(const uint8_t* p, uint64_t base, uint8_t width, int i) noexcept {
+		uint64_t off;
+		switch (width) {
+		case 1: off = p[i]; break;
+		case 2: off = reinterpret_cast<const uint16_t*>(p)[i]; break;
+		default: off = reinterpret_cast<const uint32_t*>(p)[i]; break;
+		}
+		return (K)(U)(base + off);
+	}
+
+	/* index of the first key not less than key */
+	static int lower_index(const uint8_t* p, uint64_t base, uint8_t width,
+			int n, const K& key) noexcept {
+		if (key < (K)(U)base)
+			return 0;
+		uint64_t d = (uint64_t)((U)key - (U)base);
+		if (d >> (width * 8))
+			return n;
+		switch (width) {
+		case 1: return count_less<uint8_t>(p, n, d);
+		case 2: return count_less<uint16_t>(p, n, d);
+		default: return count_less<uint32_t>(p, n, d);
+		}
+	}
+
+private:
+	template <typename T>
+	static void put(const bpvec<K>& keys, bpvec<uint8_t>& out,
+			uint64_t base) noexcept {
+		T* o = reinterpret_cast<T*>(out.data());
+		for (size_t i = 0; i < keys.size(); i++)
+			o[i] = (T)((U)keys[i] - (U)base);
+	}
+
+	/* branch free, so the compiler can vectorize the scan */
+	template <typename T>
+	static int count_less(const uint8_t* p, int n, uint64_t d) noexcept {
+		const T* o = reinterpret_cast<const T*>(p);
+		T t = (T)d;
+		int c = 0;
+		for (int i = 0; i < n; i++)
+			c += o[i] < t;
+		return c;
+	}
+};
 
 template <typename K, typename V>
 class bpnode {
 protected:
 	bpnode_type type;
-	int16_t num_keys;
-	std::vector<K> keys;
+	int32_t num_keys;
+	bpvec<K> keys;
 	bpnode<K,V> *parent;
 
 public:
-	friend class bptree<K,V>;
-	bpnode(bpnode_type type_, int16_t nk_, bpnode<K,V> *p_) :
+	template <typename, typename, typename> friend class bptree;
+	bpnode(bpnode_type type_, int32_t nk_, bpnode<K,V> *p_) :
 		type{type_}, num_keys{nk_}, parent{p_} {}
 	virtual bpnode_type get_type() const noexcept = 0;
-	int16_t get_num_keys() const noexcept { return num_keys; }
+	int32_t get_num_keys() const noexcept { return num_keys; }
 	bool is_leaf() const noexcept { return get_type() == NODE_LEAF; }
 	bool is_inner() const noexcept { return get_type() == NODE_INNER; }
 	virtual ~bpnode() {};
-
-private:
-	int check_children_index_by_key(const K& key) const noexcept;
 };
 
 template <typename K, typename V>
 class bpnode_leaf : public bpnode<K,V> {
 protected:
-	std::vector<V> values;	
+	bpvec<V> values;	
 	bpnode<K,V> *next;
+	/* when width != 0 keys is empty and the keys live in packed */
+	bpvec<uint8_t> packed;
+	uint64_t base;
+	uint8_t width;
 
 public:
-	friend class bptree<K,V>;
-	bpnode_leaf(int m_) : next{nullptr}, bpnode<K,V>{NODE_LEAF, 0, nullptr} {
+	template <typename, typename, typename> friend class bptree;
+	bpnode_leaf(int m_) : next{nullptr}, base{0}, width{0},
+			bpnode<K,V>{NODE_LEAF, 0, nullptr} {
 		this->keys.reserve(m_);
 		values.reserve(m_);
 	}
@@ -59,13 +226,23 @@ public:
 };
 
 
+/* a write parked in an inner node buffer, waiting to be pushed down */
+template <typename K, typename V>
+struct bpmsg {
+	K key;
+	V value;
+	bool erase;
+};
+
 template <typename K, typename V>
 class bpnode_inner : public bpnode<K,V> {
 protected:
-	std::vector<bpnode<K,V>*> children;
+	bpvec<bpnode<K,V>*> children;
+	/* pending writes for this subtree, sorted by key, one per key */
+	bpvec<bpmsg<K,V>> buffer;
 
 public:
-	friend class bptree<K,V>;
+	template <typename, typename, typename> friend class bptree;
 	bpnode_inner(int m_) : bpnode<K,V>{NODE_INNER, 0, nullptr} {
 		this->keys.reserve(m_);
 		children.reserve(m_ + 1);
@@ -74,31 +251,84 @@ public:
 	virtual ~bpnode_inner() {}
 };
 
-template <typename K, typename V>
+template <typename K, typename V, typename C>
 class bptree {
 protected:
 	bpnode<K,V> *root;
 	int depth;
-	int count;
+	uint64_t count;
 	int m;
+	bool compress;
+	C cmp;
+	/* leaves unpacked by the running operation, packed again at its end */
+	std::vector<bpnode_leaf<K,V>*> unpacked;
+	/* write buffering: buffer_cap 0 is off, pending counts parked writes */
+	size_t buffer_cap;
+	uint64_t pending;
+	std::vector<bpmsg<K,V>> orphans;
+	/* node memory, nullptr for the heap */
+	bpnode_memory* mem;
+	/* set: every write checks the nodes it touched */
+	bpreport validate;
 
 public:
-	bptree(int m_) : m{m_}, depth{0}, count{0}, root{nullptr} {}
+	template <typename, typename, typename> friend class bptree_frozen;
+	bptree(int m_, bool compress_ = false, const C& cmp_ = C()) :
+		m{m_}, depth{0}, count{0}, root{nullptr},
+		compress{compress_ && std::is_same<C, std::less<K>>::value}, cmp{cmp_},
+		buffer_cap{0}, pending{0}, mem{nullptr} {
+		assert(m >= 3);
+	}
 	~bptree();
-	int get_count() const noexcept { return count; }
+	uint64_t get_count() const noexcept { return count; }
 	int get_depth() const noexcept { return depth; }
 	bool find_key(const K& key, V*& value) const noexcept;
+	template <int G = 16>
+	size_t find_many(const K* keys, V** values, size_t n) const noexcept;
+	template <typename F> bool scan_range(const K& from, const K& to, F fn) const;
+	template <typename F> bool scan_all(F fn) const;
+	template <typename F> bool update_all(F fn);
 	void insert_key(const K& key, const V& value) noexcept;
 	bool delete_key(const K& key) noexcept;
+	void split_at(const K& key, bptree<K,V,C>& right) noexcept;
+	bool join(bptree<K,V,C>& other) noexcept;
+	void merge(bptree<K,V,C>& other) noexcept;
+	void set_write_buffer(size_t cap) noexcept;
+	void flush() noexcept;
+	uint64_t get_pending() const noexcept { return pending; }
+	void set_memory(bpnode_memory* mem_) noexcept;
+	bptree_frozen<K,V,C> freeze();
 	void dump() const noexcept;
 	void dump_brief() const noexcept;
 	void dump_leaf_keys() const noexcept;
 	void check() const noexcept;
+	size_t check_sampled(const bpreport& report, size_t stride = 1,
+			size_t phase = 0) const;
+	void set_validate(const bpreport& report) noexcept { validate = report; }
 
 private:
-	void check_node(bpnode<K,V>* p, bpnode<K,V>* n) const noexcept;
-	void destroy_node(bpnode<K,V> *n);
+	bool validate_node(const bpnode<K,V>* n, const bpnode<K,V>* p,
+			const K* lo, const K* hi, int level, bpvec<K>& buf,
+			const bpreport& report) const noexcept;
+	void validate_path(const K& key, const bpreport& report) const noexcept;
+	void destroy_node(bpnode<K,V> *n) noexcept;
+	bool key_eq(const K& a, const K& b) const noexcept {
+		return !cmp(a, b) && !cmp(b, a);
+	}
+	K separator(const K& left, const K& right) const noexcept;
+	int check_children_index_by_key(const bpnode<K,V>* n,
+			const K& key) const noexcept;
 	bool find_leaf(const K& key, int& idx, bpnode_leaf<K,V>*& node) const noexcept;
+	bpnode_leaf<K,V>* leaf_bound(const K& key, const K*& hi) const noexcept;
+	K leaf_key(const bpnode_leaf<K,V>* n, int i) const noexcept;
+	const K* leaf_keys(const bpnode_leaf<K,V>* n, bpvec<K>& buf) const noexcept;
+	int leaf_lower(const bpnode_leaf<K,V>* n, const K& key) const noexcept;
+	bool leaf_find(const bpnode_leaf<K,V>* n, const K& key, int& idx) const noexcept;
+	void leaf_unpack(bpnode_leaf<K,V>* n) noexcept;
+	void leaf_pack(bpnode_leaf<K,V>* n) noexcept;
+	void leaf_touch(bpnode_leaf<K,V>* n) noexcept;
+	void leaf_forget(bpnode_leaf<K,V>* n) noexcept;
+	void pack_touched() noexcept;
 	void insert_leaf_node(bpnode_leaf<K,V>* n, const K& key, const V& value) noexcept;
 	void leaf_split_if_full(bpnode_leaf<K,V>* n) noexcept;
 	void insert_inner_node(bpnode_inner<K,V>* n, const K& key,
@@ -122,101 +352,512 @@ private:
 	void inner_borrow_right(bpnode_inner<K,V>* n, bpnode_inner<K,V>* s) noexcept;
 	bpnode_inner<K,V>* inner_merge_left(
 			bpnode_inner<K,V>* n, bpnode_inner<K,V>* s) noexcept;
+	bpnode_leaf<K,V>* first_leaf(bpnode<K,V>* n) const noexcept;
+	bpnode_leaf<K,V>* last_leaf(bpnode<K,V>* n) const noexcept;
+	void rebalance_pair(bpnode_inner<K,V>* p, int j) noexcept;
+	void join_right(bpnode<K,V>* b, int hb) noexcept;
+	void join_left(bpnode<K,V>* a, int ha) noexcept;
+	void destroy_inner(bpnode<K,V>* n) noexcept;
+	template <typename KK, typename VV>
+	void bulk_append(std::vector<bpnode_leaf<K,V>*>& leaves,
+			KK&& key, VV&& value) noexcept;
+	void bulk_finish(std::vector<bpnode_leaf<K,V>*>& leaves) noexcept;
+	void apply_insert(const K& key, const V& value) noexcept;
+	bool apply_delete(const K& key) noexcept;
+	void apply_msg(const bpmsg<K,V>& msg) noexcept;
+	void leaf_apply_batch(bpnode_leaf<K,V>* n, bpmsg<K,V>* msgs, size_t nmsgs) noexcept;
+	void apply_sorted(bpmsg<K,V>* msgs, size_t nmsgs) noexcept;
+	void leaf_settle(bpnode_leaf<K,V>* n) noexcept;
+	void buffer_put(bpnode_inner<K,V>* n, const bpmsg<K,V>& msg) noexcept;
+	const bpmsg<K,V>* buffer_find(const bpnode_inner<K,V>* n,
+			const K& key) const noexcept;
+	void buffer_merge(bpnode_inner<K,V>* n, bpvec<bpmsg<K,V>>& batch) noexcept;
+	void buffer_split(bpnode_inner<K,V>* from, bpnode_inner<K,V>* to,
+			const K& key, bool upper) noexcept;
+	bpnode_inner<K,V>* flush_batch(bpnode_inner<K,V>* n) noexcept;
+	void flush_path() noexcept;
+	template <typename N> N* node_new() noexcept;
+	void node_free(bpnode<K,V>* n) noexcept;
 };
 
-template <typename K, typename V>
-bptree<K,V>::~bptree() {
+template <typename K, typename V, typename C>
+bptree<K,V,C>::~bptree() {
+	bpmem_scope scope(mem);
+
 	if (root == nullptr)
 		return;
 	destroy_node(root);
 }
 
-template <typename K, typename V>
-void bptree<K,V>::check() const noexcept {
-	if (root == nullptr)
+/* place the nodes of this (still empty) tree in mem, the node arrays go
+ * to bpmem_current() which the writing operations set to mem. trees
+ * exchanging nodes through split_at or join must share their memory
+*/
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::set_memory(bpnode_memory* mem_) noexcept {
+	assert(root == nullptr);
+	mem = mem_;
+}
+
+template <typename K, typename V, typename C>
+template <typename N>
+N* bptree<K,V,C>::node_new() noexcept {
+	if (mem == nullptr)
+		return new N(m);
+	/* falls back to the heap when the memory cannot map a region */
+	return new (mem->allocate(sizeof(N))) N(m);
+}
+
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::node_free(bpnode<K,V>* n) noexcept {
+	if (mem == nullptr) {
+		delete n;
 		return;
+	}
+	size_t size = n->is_leaf() ? sizeof(bpnode_leaf<K,V>) : sizeof(bpnode_inner<K,V>);
+	n->~bpnode();
+	mem->deallocate(n, size);
+}
 
-	if (depth == 1 && root->is_inner()) {
-		std::cout << "check tree: depth 1 but root inner" << std::endl;
+/* full check, the first problem is printed and ends the process */
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::check() const noexcept {
+	check_sampled([](const std::string& msg) {
+		std::cout << "check tree: " << msg << std::endl;
 		exit(-1);
+	});
+}
+
+/* walk the tree level by level, every inner node is checked but only
+ * every stride-th leaf (starting at phase), so a big tree can be checked
+ * in slices. only inner nodes are queued, leaves are reached through
+ * their parent's child array and skipped ones are never loaded. problems
+ * go to report, the number found is returned
+*/
+template <typename K, typename V, typename C>
+size_t bptree<K,V,C>::check_sampled(const bpreport& report,
+			size_t stride, size_t phase) const {
+	struct item {
+		bpnode_inner<K,V>* n;
+		const K* lo;
+		const K* hi;
+	};
+	std::vector<item> level, next;
+	bpvec<K> buf;
+	uint64_t keys = 0;
+	size_t errors = 0, leaf = 0;
+	bpreport counted = [&](const std::string& msg) {
+		errors++;
+		report(msg);
+	};
+
+	if (stride == 0)
+		stride = 1;
+	if (root == nullptr) {
+		if (count != 0)
+			counted("empty tree, count " + std::to_string(count));
+		return errors;
+	}
+	if (root->type != (depth == 1 ? NODE_LEAF : NODE_INNER)) {
+		counted("depth " + std::to_string(depth) + ", wrong root type");
+		return errors;
+	}
+	if (!validate_node(root, nullptr, nullptr, nullptr, 0, buf, counted))
+		return errors;
+
+	if (depth == 1) {
+		if (static_cast<bpnode_leaf<K,V>*>(root)->next != nullptr)
+			counted("level 0: broken next link");
+		keys = root->num_keys;
+	} else {
+		level.push_back(item{static_cast<bpnode_inner<K,V>*>(root), nullptr, nullptr});
+	}
+
+	/* the children of level l - 1 are leaves exactly when l is depth - 1 */
+	for (int l = 1; !level.empty(); l++) {
+		bool leaves = (l == depth - 1);
+		for (size_t pi = 0; pi < level.size(); pi++) {
+			bpnode_inner<K,V>* n = level[pi].n;
+			for (int c = 0; c <= n->num_keys; c++) {
+				bpnode<K,V>* ch = n->children[c];
+				const K* lo = c > 0 ? &n->keys[c - 1] : level[pi].lo;
+				const K* hi = c < n->num_keys ? &n->keys[c] : level[pi].hi;
+
+				if (leaves && (leaf++ + phase) % stride != 0)
+					continue;
+				if (ch->type != (leaves ? NODE_LEAF : NODE_INNER)) {
+					counted("level " + std::to_string(l) + ": leaves at different depths");
+					continue;
+				}
+				if (!validate_node(ch, n, lo, hi, l, buf, counted))
+					continue;
+				if (!leaves) {
+					next.push_back(item{static_cast<bpnode_inner<K,V>*>(ch), lo, hi});
+					continue;
+				}
+				bpnode<K,V>* succ = c < n->num_keys ? n->children[c + 1] :
+					pi + 1 < level.size() ? level[pi + 1].n->children[0] : nullptr;
+				if (static_cast<bpnode_leaf<K,V>*>(ch)->next != succ)
+					counted("level " + std::to_string(l) + ": broken next link");
+				keys += ch->num_keys;
+			}
+		}
+		level.swap(next);
+		next.clear();
 	}
 
-	check_node(nullptr, root);
+	if (stride == 1 && pending == 0 && keys != count)
+		counted("count " + std::to_string(count) + ", leaves hold " +
+			std::to_string(keys));
+	return errors;
 }
 
-template <typename K, typename V>
-void bptree<K,V>::check_node(bpnode<K,V>* p, bpnode<K,V>* n) const noexcept {
-	if (n->parent != p) {
-		std::cout << "check node: found err, parent not match" << std::endl;
-		exit(-2);
+/* check one node against its parent and the separators around it:
+ * lo <= key < hi for every key. returns false when the node header or
+ * arrays are broken, so its children or siblings can't be looked at
+*/
+template <typename K, typename V, typename C>
+bool bptree<K,V,C>::validate_node(const bpnode<K,V>* n, const bpnode<K,V>* p,
+			const K* lo, const K* hi, int level, bpvec<K>& buf,
+			const bpreport& report) const noexcept {
+	auto at = [level]() { return "level " + std::to_string(level) + ": "; };
+	int min_limits = (p == nullptr) ? 1 : (m - 1) / 2;
+	const K* keys;
+	int ks;
+
+	if (n->type != n->get_type() || n->parent != p) {
+		report(at() + "bad node header");
+		return false;
 	}
-	if (n->num_keys >= m) {
-		std::cout << "check node: found err, num_keys " << n->num_keys << " >= "
-				<< m << std::endl;
-		exit(-1);
+	if (n->num_keys >= m || n->num_keys < min_limits)
+		report(at() + "num_keys " + std::to_string(n->num_keys) + " out of [" +
+			std::to_string(min_limits) + ", " + std::to_string(m) + ")");
+
+	if (n->type == NODE_INNER) {
+		const bpnode_inner<K,V>* nn = static_cast<const bpnode_inner<K,V>*>(n);
+		if ((int)nn->keys.size() != nn->num_keys ||
+				(int)nn->children.size() != nn->num_keys + 1) {
+			report(at() + "inner sizes do not match num_keys");
+			return false;
+		}
+		for (size_t i = 0; i < nn->buffer.size(); i++) {
+			const K& k = nn->buffer[i].key;
+			if ((i > 0 && !cmp(nn->buffer[i - 1].key, k)) ||
+					(lo && cmp(k, *lo)) || (hi && !cmp(k, *hi))) {
+				report(at() + "buffer out of order");
+				break;
+			}
+		}
+		keys = nn->keys.data();
+		ks = nn->num_keys;
+	} else {
+		const bpnode_leaf<K,V>* nn = static_cast<const bpnode_leaf<K,V>*>(n);
+		int nk = nn->width ? nn->packed.size() / nn->width : nn->keys.size();
+		if (nk != nn->num_keys || (int)nn->values.size() != nn->num_keys ||
+				(nn->width && !nn->keys.empty())) {
+			report(at() + "leaf sizes do not match num_keys");
+			return false;
+		}
+		keys = leaf_keys(nn, buf);
+		ks = nn->num_keys;
 	}
 
-	if (n->is_inner()) {
-		bpnode_inner<K,V>* nn = dynamic_cast<bpnode_inner<K,V>*>(n);
-		int ks = nn->keys.size();
-		int cs = nn->children.size();
-		if (ks != nn->num_keys || cs != nn->num_keys + 1) {
-			std::cout << "check node: found err, ks " << ks << " cs " << cs 
-				<< " key_nums " << nn->num_keys << std::endl;
-			exit(-2);
+	for (int i = 1; i < ks; i++) {
+		if (!cmp(keys[i - 1], keys[i])) {
+			report(at() + "keys out of order");
+			break;
 		}
-		for (bpnode<K,V>* &c : nn->children)
-			check_node(n, c);
-	} else {
-		bpnode_leaf<K,V>* nn = dynamic_cast<bpnode_leaf<K,V>*>(n);
-		int ks = nn->keys.size();
-		int vs = nn->keys.size();
-		if (ks != nn->num_keys || vs != nn->num_keys) {
-			std::cout << "check node: found err, ks " << ks << " vs " << vs
-				<< " key_nums " << nn->num_keys << std::endl;
-			exit(-3);
+	}
+	if (ks > 0 && ((lo && cmp(keys[0], *lo)) || (hi && !cmp(keys[ks - 1], *hi))))
+		report(at() + "keys outside the parent separators");
+	return true;
+}
+
+/* check only what an operation on key can have changed: the nodes on its
+ * path, their siblings next to the path (borrow, merge and split partners)
+ * and the leaf links around the path leaf
+*/
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::validate_path(const K& key, const bpreport& report) const noexcept {
+	bpnode<K,V> *n = root, *p = nullptr, *succ = nullptr;
+	const K *lo = nullptr, *hi = nullptr;
+	bpvec<K> buf;
+	int level = 0;
+
+	if (!report || n == nullptr)
+		return;
+
+	for (;; level++) {
+		if (!validate_node(n, p, lo, hi, level, buf, report))
+			return;
+		if (n->type == NODE_LEAF)
+			break;
+
+		bpnode_inner<K,V>* inner = static_cast<bpnode_inner<K,V>*>(n);
+		int i = check_children_index_by_key(inner, key);
+		bpnode<K,V>* c = inner->children[i];
+		if (i > 0 && validate_node(inner->children[i - 1], inner,
+				i > 1 ? &inner->keys[i - 2] : lo, &inner->keys[i - 1],
+				level + 1, buf, report) && c->type == NODE_LEAF &&
+				static_cast<bpnode_leaf<K,V>*>(inner->children[i - 1])->next != c)
+			report("level " + std::to_string(level + 1) + ": broken next link");
+		if (i < inner->num_keys) {
+			validate_node(inner->children[i + 1], inner, &inner->keys[i],
+				i + 1 < inner->num_keys ? &inner->keys[i + 1] : hi,
+				level + 1, buf, report);
+			succ = inner->children[i + 1];
 		}
+		p = n;
+		lo = i > 0 ? &inner->keys[i - 1] : lo;
+		hi = i < inner->num_keys ? &inner->keys[i] : hi;
+		n = c;
 	}
+
+	if (static_cast<bpnode_leaf<K,V>*>(n)->next !=
+			(succ == nullptr ? nullptr : first_leaf(succ)))
+		report("level " + std::to_string(level) + ": broken next link");
+	if (level + 1 != depth)
+		report("depth " + std::to_string(depth) + ", leaf at level " +
+			std::to_string(level));
 }
 
-template <typename K, typename V>
-void bptree<K,V>::destroy_node(bpnode<K,V> *n) {
+/* free the whole tree under n (the root): inner levels first, then the
+ * leaves in chain order
+*/
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::destroy_node(bpnode<K,V> *n) noexcept {
 	if (n == nullptr)
 		return;
-	if (n->is_leaf()) {
-		delete n;
-		return;
+	bpnode_leaf<K,V>* l = first_leaf(n);
+	destroy_inner(n);
+	while (l != nullptr) {
+		bpnode_leaf<K,V>* t = l;
+		l = dynamic_cast<bpnode_leaf<K,V>*>(l->next);
+		node_free(t);
 	}
-	for (bpnode<K,V>* &c : (dynamic_cast<bpnode_inner<K,V>*>(n))->children) 
-		destroy_node(c);
-	delete n;
 }
 
-template <typename K, typename V>
-int bpnode<K,V>::check_children_index_by_key(const K& key) const noexcept {
+/* packed keys are only ordered the natural way, so separators are only
+ * shortened for the default comparator
+*/
+template <typename K, typename V, typename C>
+K bptree<K,V,C>::separator(const K& left, const K& right) const noexcept {
+	if (std::is_same<C, std::less<K>>::value)
+		return bpkey_traits<K>::separator(left, right);
+	return right;
+}
+
+template <typename K, typename V, typename C>
+int bptree<K,V,C>::check_children_index_by_key(const bpnode<K,V>* n,
+			const K& key) const noexcept {
 	int index = 0;
-	while (index < num_keys) {
-		if (key < keys[index])
+	while (index < n->num_keys) {
+		if (cmp(key, n->keys[index]))
 			return index;
 		index++;
 	}
 	return index;
 }
 
-template <typename K, typename V>
-bool bptree<K,V>::find_key(const K& k, V*& v) const noexcept {
+template <typename K, typename V, typename C>
+bool bptree<K,V,C>::find_key(const K& k, V*& v) const noexcept {
+	const bpnode<K,V>* nd = root;
 	int idx;
-	bpnode_leaf<K,V>* n;
 
-	if (find_leaf(k, idx, n)) {
-		v = &n->values[idx];
+	if (nd == nullptr)
+		return false;
+
+	/* with writes parked on the path, the highest message for k is the
+	 * newest one and answers the lookup, otherwise the leaf reached by the
+	 * same descent does
+	*/
+	while (nd->is_inner()) {
+		const bpnode_inner<K,V>* inner = dynamic_cast<const bpnode_inner<K,V>*>(nd);
+		if (pending > 0) {
+			const bpmsg<K,V>* msg = buffer_find(inner, k);
+			if (msg != nullptr) {
+				if (msg->erase)
+					return false;
+				v = const_cast<V*>(&msg->value);
+				return true;
+			}
+		}
+		nd = inner->children[check_children_index_by_key(inner, k)];
+	}
+
+	const bpnode_leaf<K,V>* leaf = dynamic_cast<const bpnode_leaf<K,V>*>(nd);
+	if (leaf_find(leaf, k, idx)) {
+		v = const_cast<V*>(&leaf->values[idx]);
 		return true;
 	}
 	return false;
 }
 
-template <typename K, typename V>
-bool bptree<K,V>::find_leaf(const K& key, int& idx, bpnode_leaf<K,V>*& node) const noexcept {
+/* look up n keys, values[i] is set to the value of keys[i] or nullptr.
+ * G lookups run interleaved as small state machines, each one prefetches
+ * the next node it needs and yields to the others, so the cache misses of
+ * different descents overlap. returns the number of keys found
+*/
+template <typename K, typename V, typename C>
+template <int G>
+size_t bptree<K,V,C>::find_many(const K* keys, V** values, size_t n) const noexcept {
+	struct {
+		size_t i;
+		const bpnode<K,V>* n;
+		bool loaded;
+	} slots[G];
+	size_t next = 0, found = 0;
+	int active = 0;
+
+	if (root == nullptr) {
+		for (size_t i = 0; i < n; i++)
+			values[i] = nullptr;
+		return 0;
+	}
+
+	for (; active < G && next < n; active++) {
+		slots[active].i = next++;
+		slots[active].n = root;
+		slots[active].loaded = false;
+	}
+
+	while (active > 0) {
+		for (int s = 0; s < active; s++) {
+			auto &sl = slots[s];
+			const bpnode<K,V>* nd = sl.n;
+
+			/* stage 1: node header arrived, fetch its key array */
+			if (!sl.loaded) {
+				const uint8_t* packed = (nd->type == NODE_LEAF) ?
+					static_cast<const bpnode_leaf<K,V>*>(nd)->packed.data() :
+					nullptr;
+				if (packed != nullptr)
+					BPTREE_PREFETCH(packed);
+				else
+					BPTREE_PREFETCH(nd->keys.data());
+				sl.loaded = true;
+				continue;
+			}
+
+			/* stage 2: search the node, then prefetch the next hop */
+			const K& key = keys[sl.i];
+			const bpmsg<K,V>* msg = nullptr;
+			if (nd->type == NODE_INNER) {
+				const bpnode_inner<K,V>* inner =
+					static_cast<const bpnode_inner<K,V>*>(nd);
+				/* a parked write for key is newer than anything below */
+				if (pending == 0 || (msg = buffer_find(inner, key)) == nullptr) {
+					sl.n = inner->children[check_children_index_by_key(inner, key)];
+					sl.loaded = false;
+					BPTREE_PREFETCH(sl.n);
+					continue;
+				}
+			}
+
+			int j;
+			if (msg != nullptr) {
+				values[sl.i] = msg->erase ? nullptr : const_cast<V*>(&msg->value);
+				found += !msg->erase;
+			} else {
+				const bpnode_leaf<K,V>* leaf = static_cast<const bpnode_leaf<K,V>*>(nd);
+				if (leaf_find(leaf, key, j)) {
+					values[sl.i] = const_cast<V*>(&leaf->values[j]);
+					found++;
+				} else {
+					values[sl.i] = nullptr;
+				}
+			}
+
+			/* slot done, start the next key or retire the slot */
+			if (next < n) {
+				sl.i = next++;
+				sl.n = root;
+				sl.loaded = false;
+			} else {
+				slots[s--] = slots[--active];
+			}
+		}
+	}
+	return found;
+}
+
+/* call fn(key, value) for every key in [from, to) in order, stop as soon
+ * as fn returns false. returns false if stopped by fn
+*/
+template <typename K, typename V, typename C>
+template <typename F>
+bool bptree<K,V,C>::scan_range(const K& from, const K& to, F fn) const {
+	int idx;
+	bpnode_leaf<K,V>* n;
+
+	bpvec<K> buf;
+
+	assert(pending == 0);
+	find_leaf(from, idx, n);
+	if (n == nullptr)
+		return true;
+
+	idx = leaf_lower(n, from);
+	while (n != nullptr) {
+		const K* keys = leaf_keys(n, buf);
+		for (; idx < n->num_keys; idx++) {
+			if (!cmp(keys[idx], to))
+				return true;
+			if (!fn(keys[idx], n->values[idx]))
+				return false;
+		}
+		n = dynamic_cast<bpnode_leaf<K,V>*>(n->next);
+		idx = 0;
+	}
+	return true;
+}
+
+template <typename K, typename V, typename C>
+template <typename F>
+bool bptree<K,V,C>::scan_all(F fn) const {
+	assert(pending == 0);
+	if (root == nullptr)
+		return true;
+
+	bpnode<K,V>* n = root;
+	while (n->is_inner())
+		n = dynamic_cast<bpnode_inner<K,V>*>(n)->children[0];
+
+	bpvec<K> buf;
+	while (n != nullptr) {
+		bpnode_leaf<K,V>* leaf = dynamic_cast<bpnode_leaf<K,V>*>(n);
+		const K* keys = leaf_keys(leaf, buf);
+		for (int i = 0; i < leaf->num_keys; i++) {
+			if (!fn(keys[i], leaf->values[i]))
+				return false;
+		}
+		n = leaf->next;
+	}
+	return true;
+}
+
+/* like scan_all but fn(key, value) gets the value to modify in place */
+template <typename K, typename V, typename C>
+template <typename F>
+bool bptree<K,V,C>::update_all(F fn) {
+	assert(pending == 0);
+	if (root == nullptr)
+		return true;
+
+	bpvec<K> buf;
+	for (bpnode_leaf<K,V>* leaf = first_leaf(root); leaf != nullptr;
+			leaf = static_cast<bpnode_leaf<K,V>*>(leaf->next)) {
+		const K* keys = leaf_keys(leaf, buf);
+		for (int i = 0; i < leaf->num_keys; i++) {
+			if (!fn(keys[i], leaf->values[i]))
+				return false;
+		}
+	}
+	return true;
+}
+
+template <typename K, typename V, typename C>
+bool bptree<K,V,C>::find_leaf(const K& key, int& idx, bpnode_leaf<K,V>*& node) const noexcept {
 	bpnode<K,V> *n = root;
 	int i;
 
@@ -228,25 +869,145 @@ bool bptree<K,V>::find_leaf(const K& key, int& idx, bpnode_leaf<K,V>*& node) con
 	bpnode_inner<K,V>* inner;
 	while (!n->is_leaf()) {
 		inner = dynamic_cast<bpnode_inner<K,V>*>(n);
-		i = inner->check_children_index_by_key(key);
+		i = check_children_index_by_key(inner, key);
 		assert(inner->children[i] != nullptr);
 		n = inner->children[i];
 	}
 	node = dynamic_cast<bpnode_leaf<K,V>*>(n);
-	for (i = 0; i < n->num_keys; i++) {
-		if (n->keys[i] == key) {
-			idx = i;
-			return true;
+	return leaf_find(node, key, idx);
+}
+
+/* the leaf key routes to, hi is set to the separator bounding that leaf
+ * from above or nullptr for the last leaf. the tree must not be empty
+*/
+template <typename K, typename V, typename C>
+bpnode_leaf<K,V>* bptree<K,V,C>::leaf_bound(const K& key, const K*& hi) const noexcept {
+	bpnode<K,V>* n = root;
+
+	hi = nullptr;
+	while (n->is_inner()) {
+		bpnode_inner<K,V>* inner = dynamic_cast<bpnode_inner<K,V>*>(n);
+		int i = check_children_index_by_key(inner, key);
+		if (i < inner->num_keys)
+			hi = &inner->keys[i];
+		n = inner->children[i];
+	}
+	return dynamic_cast<bpnode_leaf<K,V>*>(n);
+}
+
+template <typename K, typename V, typename C>
+K bptree<K,V,C>::leaf_key(const bpnode_leaf<K,V>* n, int i) const noexcept {
+	if (n->width)
+		return bpkey_codec<K>::get(n->packed.data(), n->base, n->width, i);
+	return n->keys[i];
+}
+
+/* keys of n as a plain array, packed leaves are decoded into buf */
+template <typename K, typename V, typename C>
+const K* bptree<K,V,C>::leaf_keys(const bpnode_leaf<K,V>* n,
+			bpvec<K>& buf) const noexcept {
+	if (!n->width)
+		return n->keys.data();
+	buf.resize(n->num_keys);
+	for (int i = 0; i < n->num_keys; i++)
+		buf[i] = bpkey_codec<K>::get(n->packed.data(), n->base, n->width, i);
+	return buf.data();
+}
+
+template <typename K, typename V, typename C>
+int bptree<K,V,C>::leaf_lower(const bpnode_leaf<K,V>* n, const K& key) const noexcept {
+	if (n->width)
+		return bpkey_codec<K>::lower_index(n->packed.data(), n->base,
+				n->width, n->num_keys, key);
+	int i = 0;
+	while (i < n->num_keys && cmp(n->keys[i], key))
+		i++;
+	return i;
+}
+
+template <typename K, typename V, typename C>
+bool bptree<K,V,C>::leaf_find(const bpnode_leaf<K,V>* n, const K& key,
+			int& idx) const noexcept {
+	int i = leaf_lower(n, key);
+	if (i >= n->num_keys)
+		return false;
+	if (n->width ? !key_eq(leaf_key(n, i), key) : !key_eq(n->keys[i], key))
+		return false;
+	idx = i;
+	return true;
+}
+
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::leaf_unpack(bpnode_leaf<K,V>* n) noexcept {
+	if (!n->width)
+		return;
+	n->keys.reserve(m);
+	leaf_keys(n, n->keys);
+	bpvec<uint8_t>().swap(n->packed);
+	n->width = 0;
+}
+
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::leaf_pack(bpnode_leaf<K,V>* n) noexcept {
+	if (n->width || n->num_keys == 0)
+		return;
+	n->width = bpkey_codec<K>::pack(n->keys, n->packed, n->base);
+	if (n->width)
+		bpvec<K>().swap(n->keys);
+	else
+		n->packed.clear();
+}
+
+/* n is about to be modified: decode it and, if this tree compresses,
+ * remember to encode it again when the operation finishes
+*/
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::leaf_touch(bpnode_leaf<K,V>* n) noexcept {
+	leaf_unpack(n);
+	if (!compress)
+		return;
+	for (auto &l : unpacked) {
+		if (l == n)
+			return;
+	}
+	unpacked.push_back(n);
+}
+
+/* n is about to be freed */
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::leaf_forget(bpnode_leaf<K,V>* n) noexcept {
+	for (size_t i = 0; i < unpacked.size(); i++) {
+		if (unpacked[i] == n) {
+			unpacked.erase(unpacked.begin() + i);
+			return;
 		}
 	}
-	return false;
 }
 
-template <typename K, typename V>
-void bptree<K,V>::insert_key(const K& key, const V& value) noexcept {
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::pack_touched() noexcept {
+	for (auto &l : unpacked)
+		leaf_pack(l);
+	unpacked.clear();
+}
+
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::insert_key(const K& key, const V& value) noexcept {
+	bpmem_scope scope(mem);
+
+	if (buffer_cap > 0 && root != nullptr && root->is_inner()) {
+		buffer_put(dynamic_cast<bpnode_inner<K,V>*>(root), bpmsg<K,V>{key, value, false});
+		flush_path();
+		return;
+	}
+	apply_insert(key, value);
+}
+
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::apply_insert(const K& key, const V& value) noexcept {
 	bpnode_leaf<K,V> *n;
 	if (root == nullptr) {
-		n = new bpnode_leaf<K,V>(m);
+		n = node_new<bpnode_leaf<K,V>>();
 		n->keys.push_back(key);
 		n->values.push_back(value);
 		n->num_keys = 1;
@@ -254,6 +1015,8 @@ void bptree<K,V>::insert_key(const K& key, const V& value) noexcept {
 		root->parent = nullptr;
 		depth = 1;
 		count = 1;
+		leaf_touch(n);
+		pack_touched();
 		return;
 	}
 
@@ -264,16 +1027,19 @@ void bptree<K,V>::insert_key(const K& key, const V& value) noexcept {
 	}
 
 	/* insert into the bottom leaf node */
+	leaf_touch(n);
 	insert_leaf_node(n, key, value);
 	count++;
+	pack_touched();
+	validate_path(key, validate);
 }
 
-template <typename K, typename V>
-void bptree<K,V>::insert_leaf_node(bpnode_leaf<K,V>* n, const K& key, const V& value) noexcept {
-	typename std::vector<K>::iterator it = n->keys.begin();
-	typename std::vector<V>::iterator vit = n->values.begin();
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::insert_leaf_node(bpnode_leaf<K,V>* n, const K& key, const V& value) noexcept {
+	typename bpvec<K>::iterator it = n->keys.begin();
+	typename bpvec<V>::iterator vit = n->values.begin();
 	for (; it < n->keys.end(); it++, vit++) {
-		if (key < *it) {
+		if (cmp(key, *it)) {
 			n->keys.insert(it, key);
 			n->values.insert(vit, value);
 			goto done;
@@ -286,19 +1052,21 @@ done:
 	leaf_split_if_full(n);
 }
 
-template <typename K, typename V>
-void bptree<K,V>::leaf_split_if_full(bpnode_leaf<K,V>* n) noexcept {
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::leaf_split_if_full(bpnode_leaf<K,V>* n) noexcept {
 	if (n->num_keys < m)
 		return;
 
 	/* split into two, floor(m/2) left, others to new one */
-	bpnode_leaf<K,V> *new_leaf = new bpnode_leaf<K,V>(m);
+	bpnode_leaf<K,V> *new_leaf = node_new<bpnode_leaf<K,V>>();
 	int k = m / 2;
+	leaf_touch(new_leaf);
 
 	new_leaf->keys.insert(new_leaf->keys.begin(), 
 		n->keys.begin() + k, n->keys.end());
 	new_leaf->values.insert(new_leaf->values.begin(), 
-		n->values.begin() + k, n->values.end());
+		std::make_move_iterator(n->values.begin() + k),
+		std::make_move_iterator(n->values.end()));
 	n->keys.erase(n->keys.begin() + k, n->keys.end());
 	n->values.erase(n->values.begin() + k, n->values.end());
 	
@@ -314,15 +1082,15 @@ void bptree<K,V>::leaf_split_if_full(bpnode_leaf<K,V>* n) noexcept {
 	*/
 
 	insert_inner_node(dynamic_cast<bpnode_inner<K,V>*>(n->parent), 
-			new_leaf->keys[0], n, new_leaf);
+			separator(n->keys.back(), new_leaf->keys[0]), n, new_leaf);
 }
 
-template <typename K, typename V>
-void bptree<K,V>::insert_inner_node(bpnode_inner<K,V>* n, const K& key,
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::insert_inner_node(bpnode_inner<K,V>* n, const K& key,
 					bpnode<K,V>* child1, bpnode<K,V>* child2) noexcept {
 	if (n == NULL) {
 		/* it's on top, should add a new inner node as new root */
-		bpnode_inner<K,V>* new_inner = new bpnode_inner<K,V>(m);
+		bpnode_inner<K,V>* new_inner = node_new<bpnode_inner<K,V>>();
 		new_inner->num_keys = 1;
 		new_inner->keys.push_back(key);
 		new_inner->children.push_back(child1);
@@ -337,11 +1105,11 @@ void bptree<K,V>::insert_inner_node(bpnode_inner<K,V>* n, const K& key,
 	/* first insert key into the node n at right place
 	 * then check whether that inner node is full
 	*/
-	typename std::vector<K>::iterator it;
-	typename std::vector<bpnode<K,V>*>::iterator cit;
+	typename bpvec<K>::iterator it;
+	typename bpvec<bpnode<K,V>*>::iterator cit;
 	for (it = n->keys.begin(), cit = n->children.begin(); 
 				it < n->keys.end(); it++, cit++) {
-		if (key < *it) {
+		if (cmp(key, *it)) {
 			n->keys.insert(it, key);
 			*cit = child1;
 			cit++;
@@ -360,13 +1128,13 @@ void bptree<K,V>::insert_inner_node(bpnode_inner<K,V>* n, const K& key,
 	inner_split_if_full(n);
 }
 
-template <typename K, typename V>
-void bptree<K,V>::inner_split_if_full(bpnode_inner<K,V>* n) noexcept {
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::inner_split_if_full(bpnode_inner<K,V>* n) noexcept {
 	if (n->num_keys < m)
 		return;
 
 	/* split into two, floor(m/2) left old, others move to new */
-	bpnode_inner<K,V>* new_inner = new bpnode_inner<K,V>(m);
+	bpnode_inner<K,V>* new_inner = node_new<bpnode_inner<K,V>>();
 	int k = m / 2;
 
 	K up_key = n->keys[k];
@@ -382,13 +1150,14 @@ void bptree<K,V>::inner_split_if_full(bpnode_inner<K,V>* n) noexcept {
 	n->keys.erase(n->keys.begin() + k, n->keys.end());
 	n->children.erase(n->children.begin() + k + 1, n->children.end());
 	n->num_keys = k;
+	buffer_split(n, new_inner, up_key, true);
 
 	insert_inner_node(dynamic_cast<bpnode_inner<K,V>*>(n->parent), 
 		up_key, n, new_inner);
 }
 
-template <typename K, typename V>
-void bptree<K,V>::dump_brief() const noexcept {
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::dump_brief() const noexcept {
 	std::cout << "B+ tree, depth " << depth << ","
 		<< "count " << count << "\n";
 	if (root == nullptr) {
@@ -397,8 +1166,8 @@ void bptree<K,V>::dump_brief() const noexcept {
 	}
 }
 
-template <typename K, typename V>
-void bptree<K,V>::dump() const noexcept {
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::dump() const noexcept {
 	std::cout << "B+ tree, depth " << depth << ","
 		<< "count " << count << ":\n";
 	if (root == nullptr) {
@@ -409,8 +1178,8 @@ void bptree<K,V>::dump() const noexcept {
 	dump_node(root, nullptr, 0);
 }
 
-template <typename K, typename V>
-void bptree<K,V>::print_keys_range(int level, const K* key, const V* value,
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::print_keys_range(int level, const K* key, const V* value,
 		bool is_leaf, bool is_null) const noexcept {
 	for (int i = 0; i < level; i++)
 		std::cout << "\t";
@@ -425,8 +1194,8 @@ void bptree<K,V>::print_keys_range(int level, const K* key, const V* value,
 	std::cout << std::endl;
 }
 
-template <typename K, typename V>
-void bptree<K,V>::dump_node(const bpnode<K,V>* n, const bpnode<K,V>* p, long level) const noexcept {
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::dump_node(const bpnode<K,V>* n, const bpnode<K,V>* p, long level) const noexcept {
 	if (n == nullptr) {
 		print_keys_range(level, nullptr, nullptr, false, true);
 		return;
@@ -438,10 +1207,11 @@ void bptree<K,V>::dump_node(const bpnode<K,V>* n, const bpnode<K,V>* p, long lev
 		return;
 	}
 	if (n->is_leaf()) {
+		const bpnode_leaf<K,V>* leaf = dynamic_cast<const bpnode_leaf<K,V>*>(n);
+		bpvec<K> buf;
+		const K* keys = leaf_keys(leaf, buf);
 		for (int i = 0; i < n->num_keys; i++) {
-			print_keys_range(
-				level, &n->keys[i], 
-				&(dynamic_cast<const bpnode_leaf<K,V>*>(n)->values[i]), 
+			print_keys_range(level, &keys[i], &leaf->values[i],
 				true, false);
 		}
 		return;
@@ -455,8 +1225,8 @@ void bptree<K,V>::dump_node(const bpnode<K,V>* n, const bpnode<K,V>* p, long lev
 	}
 }
 
-template <typename K, typename V>
-void bptree<K,V>::dump_leaf_keys() const noexcept {
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::dump_leaf_keys() const noexcept {
 	if (root == nullptr) {
 		std::cout << "{}" << std::endl;
 		return;
@@ -466,39 +1236,60 @@ void bptree<K,V>::dump_leaf_keys() const noexcept {
 	while (n->is_inner())
 		n = dynamic_cast<bpnode_inner<K,V>*>(n)->children[0];
 
+	bpvec<K> buf;
 	while (n != nullptr) {
-		std::cout << "{" << n->keys[0];
+		bpnode_leaf<K,V>* leaf = dynamic_cast<bpnode_leaf<K,V>*>(n);
+		const K* keys = leaf_keys(leaf, buf);
+		std::cout << "{" << keys[0];
 		for (int i = 1; i < n->num_keys; i++)
-			std::cout << "," << n->keys[i];
+			std::cout << "," << keys[i];
 		std::cout << "} ";
-		n = dynamic_cast<bpnode_leaf<K,V>*>(n)->next;
+		n = leaf->next;
 	}
 	std::cout << std::endl;
 }
 
-template <typename K, typename V>
-bool bptree<K,V>::delete_key(const K& key) noexcept {
+/* with write buffering on, the delete is parked blind and true only means
+ * it was queued, a missing key is dropped silently when it reaches a leaf
+*/
+template <typename K, typename V, typename C>
+bool bptree<K,V,C>::delete_key(const K& key) noexcept {
+	bpmem_scope scope(mem);
+
+	if (buffer_cap > 0 && root != nullptr && root->is_inner()) {
+		buffer_put(dynamic_cast<bpnode_inner<K,V>*>(root), bpmsg<K,V>{key, V(), true});
+		flush_path();
+		return true;
+	}
+	return apply_delete(key);
+}
+
+template <typename K, typename V, typename C>
+bool bptree<K,V,C>::apply_delete(const K& key) noexcept {
 	bpnode_leaf<K,V>* n;
 	int idx;
 	if (!find_leaf(key, idx, n)) {
 		return false;
 	}
 	if (count == 1) {
-		delete root;
+		node_free(root);
 		root = nullptr;
 		count = 0;
 		depth = 0;
 		return true;
 	}
+	leaf_touch(n);
 	remove_leaf_key(n, key);
 	count--;
+	pack_touched();
+	validate_path(key, validate);
 	return true;
 }
 
-template <typename K, typename V>
-void bptree<K,V>::remove_leaf_key(bpnode_leaf<K,V>* n, const K& key) noexcept {
-	typename std::vector<K>::iterator it;
-	typename std::vector<V>::iterator vit;
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::remove_leaf_key(bpnode_leaf<K,V>* n, const K& key) noexcept {
+	typename bpvec<K>::iterator it;
+	typename bpvec<V>::iterator vit;
 	int i;
 	bpnode_inner<K,V>* p;
 	bpnode<K,V> *left, *right;
@@ -508,7 +1299,7 @@ void bptree<K,V>::remove_leaf_key(bpnode_leaf<K,V>* n, const K& key) noexcept {
 
 	for (it = n->keys.begin(), vit = n->values.begin(); 
 				it < n->keys.end(); it++, vit++) {
-		if (key == *it)
+		if (key_eq(key, *it))
 			break;
 	}
 	assert(it != n->keys.end());
@@ -541,13 +1332,17 @@ void bptree<K,V>::remove_leaf_key(bpnode_leaf<K,V>* n, const K& key) noexcept {
 	get_sibling(n, &left, &right);
 	left_count = (left == nullptr) ? 0 : left->num_keys;
 	right_count = (right == nullptr) ? 0 : right->num_keys;
+	bpnode_leaf<K,V>* ls = dynamic_cast<bpnode_leaf<K,V>*>(left);
+	bpnode_leaf<K,V>* rs = dynamic_cast<bpnode_leaf<K,V>*>(right);
 	if (left_count > min_limits || right_count > min_limits) {
 		if (right_count <= left_count) {
-			leaf_borrow_left(n, dynamic_cast<bpnode_leaf<K,V>*>(left));
+			leaf_touch(ls);
+			leaf_borrow_left(n, ls);
 			p->keys.at(i - 1) = n->keys[0];
 		} else {
-			leaf_borrow_right(n, dynamic_cast<bpnode_leaf<K,V>*>(right));
-			p->keys.at(i) = right->keys[0];
+			leaf_touch(rs);
+			leaf_borrow_right(n, rs);
+			p->keys.at(i) = rs->keys[0];
 		}
 
 		return;
@@ -555,17 +1350,19 @@ void bptree<K,V>::remove_leaf_key(bpnode_leaf<K,V>* n, const K& key) noexcept {
 
 	/* sibling has not enough keys, we need to coalesce */
 	if (left_count > right_count) {
-		p = leaf_merge_left(n, dynamic_cast<bpnode_leaf<K,V>*>(left));
+		leaf_touch(ls);
+		p = leaf_merge_left(n, ls);
 	} else {
-		p = leaf_merge_right(n, dynamic_cast<bpnode_leaf<K,V>*>(right));
+		leaf_touch(rs);
+		p = leaf_merge_right(n, rs);
 	}
 
 	/* after merging, we need to check parent node */
 	check_inner_node_size(p);
 }
 
-template <typename K, typename V>
-void bptree<K,V>::get_sibling(bpnode<K,V>* n, 
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::get_sibling(bpnode<K,V>* n, 
 			bpnode<K,V>** left, bpnode<K,V>** right) const noexcept {
 	int i;
 
@@ -583,8 +1380,8 @@ void bptree<K,V>::get_sibling(bpnode<K,V>* n,
 }
 
 /* we need to check whether inner node n's key item count < m/2 */
-template <typename K, typename V>
-void bptree<K,V>::check_inner_node_size(bpnode_inner<K,V>* n) noexcept {
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::check_inner_node_size(bpnode_inner<K,V>* n) noexcept {
 	int min_limits = (m - 1) / 2;
 	bpnode<K,V> *left, *right;
 	bpnode_inner<K,V> *p;
@@ -600,6 +1397,15 @@ void bptree<K,V>::check_inner_node_size(bpnode_inner<K,V>* n) noexcept {
 			assert(n->children[0] != nullptr);
 			n->children[0]->parent = nullptr;
 			root = n->children[0];
+			/* the old root buffer is newer than anything below it */
+			if (root->is_inner())
+				buffer_merge(dynamic_cast<bpnode_inner<K,V>*>(root), n->buffer);
+			else {
+				pending -= n->buffer.size();
+				std::move(n->buffer.begin(), n->buffer.end(),
+					std::back_inserter(orphans));
+			}
+			node_free(n);
 			return;
 		}
 	}
@@ -628,10 +1434,10 @@ void bptree<K,V>::check_inner_node_size(bpnode_inner<K,V>* n) noexcept {
 	check_inner_node_size(p);
 }
 
-template <typename K, typename V>
-void bptree<K,V>::leaf_borrow_left(bpnode_leaf<K,V>* n, bpnode_leaf<K,V>* s) noexcept {
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::leaf_borrow_left(bpnode_leaf<K,V>* n, bpnode_leaf<K,V>* s) noexcept {
 	n->keys.insert(n->keys.begin(), s->keys.back());
-	n->values.insert(n->values.begin(), s->values.back());
+	n->values.insert(n->values.begin(), std::move(s->values.back()));
 	n->num_keys++;
 
 	s->keys.pop_back();
@@ -639,10 +1445,10 @@ void bptree<K,V>::leaf_borrow_left(bpnode_leaf<K,V>* n, bpnode_leaf<K,V>* s) noe
 	s->num_keys--;
 }
 
-template <typename K, typename V>
-void bptree<K,V>::leaf_borrow_right(bpnode_leaf<K,V>* n, bpnode_leaf<K,V>* s) noexcept {
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::leaf_borrow_right(bpnode_leaf<K,V>* n, bpnode_leaf<K,V>* s) noexcept {
 	n->keys.push_back(s->keys[0]);
-	n->values.push_back(s->values[0]);
+	n->values.push_back(std::move(s->values[0]));
 	n->num_keys++;
 
 	s->keys.erase(s->keys.begin());
@@ -650,8 +1456,8 @@ void bptree<K,V>::leaf_borrow_right(bpnode_leaf<K,V>* n, bpnode_leaf<K,V>* s) no
 	s->num_keys--;
 }
 
-template <typename K, typename V>
-bpnode_inner<K,V>* bptree<K,V>::leaf_merge_left(bpnode_leaf<K,V>* n, 
+template <typename K, typename V, typename C>
+bpnode_inner<K,V>* bptree<K,V,C>::leaf_merge_left(bpnode_leaf<K,V>* n, 
 				bpnode_leaf<K,V>* s) noexcept {
 	bpnode_inner<K,V>* p = dynamic_cast<bpnode_inner<K,V>*>(n->parent);
 
@@ -659,11 +1465,12 @@ bpnode_inner<K,V>* bptree<K,V>::leaf_merge_left(bpnode_leaf<K,V>* n,
 	 * node, we already have the same parent key
 	*/
 	s->keys.insert(s->keys.end(), n->keys.begin(), n->keys.end());
-	s->values.insert(s->values.end(), n->values.begin(), n->values.end());
+	s->values.insert(s->values.end(), std::make_move_iterator(n->values.begin()),
+		std::make_move_iterator(n->values.end()));
 	s->num_keys += n->num_keys;
 
-	typename std::vector<bpnode<K,V>*>::iterator it;
-	typename std::vector<K>::iterator kit;
+	typename bpvec<bpnode<K,V>*>::iterator it;
+	typename bpvec<K>::iterator kit;
 	for (it = p->children.begin(), kit = p->keys.begin(); 
 			it < p->children.end(); it++, kit++) {
 		if (n == *it) 
@@ -676,13 +1483,14 @@ bpnode_inner<K,V>* bptree<K,V>::leaf_merge_left(bpnode_leaf<K,V>* n,
 	p->num_keys--;
 
 	s->next = n->next;
-	delete n;
+	leaf_forget(n);
+	node_free(n);
 
 	return p;
 }
 
-template <typename K, typename V>
-bpnode_inner<K,V>* bptree<K,V>::leaf_merge_right(bpnode_leaf<K,V>* n,
+template <typename K, typename V, typename C>
+bpnode_inner<K,V>* bptree<K,V,C>::leaf_merge_right(bpnode_leaf<K,V>* n,
 			bpnode_leaf<K,V>* s) noexcept {
 	int i;
 	bpnode_inner<K,V>* p = dynamic_cast<bpnode_inner<K,V>*>(n->parent);
@@ -693,7 +1501,8 @@ bpnode_inner<K,V>* bptree<K,V>::leaf_merge_right(bpnode_leaf<K,V>* n,
 	}
 	assert(i < p->num_keys);
 	n->keys.insert(n->keys.end(), s->keys.begin(), s->keys.end());
-	n->values.insert(n->values.end(), s->values.begin(), s->values.end());
+	n->values.insert(n->values.end(), std::make_move_iterator(s->values.begin()),
+		std::make_move_iterator(s->values.end()));
 	n->num_keys += s->num_keys;
 
 	p->children.erase(p->children.begin() + i + 1);
@@ -703,13 +1512,14 @@ bpnode_inner<K,V>* bptree<K,V>::leaf_merge_right(bpnode_leaf<K,V>* n,
 	if (i > 0)
 		p->keys.at(i - 1) = n->keys[0];
 	n->next = s->next;
-	delete s;
+	leaf_forget(s);
+	node_free(s);
 
 	return p;
 }
 
-template <typename K, typename V>
-void bptree<K,V>::inner_borrow_left(bpnode_inner<K,V>* n, 
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::inner_borrow_left(bpnode_inner<K,V>* n, 
 				bpnode_inner<K,V>* s) noexcept {
 	int i;
 	bpnode_inner<K,V>* p = dynamic_cast<bpnode_inner<K,V>*>(n->parent);
@@ -732,10 +1542,11 @@ void bptree<K,V>::inner_borrow_left(bpnode_inner<K,V>* n,
 	s->keys.pop_back();
 	s->children.pop_back();
 	s->num_keys--;
+	buffer_split(s, n, p->keys[i - 1], true);
 }
 
-template <typename K, typename V>
-void bptree<K,V>::inner_borrow_right(bpnode_inner<K,V>* n,
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::inner_borrow_right(bpnode_inner<K,V>* n,
 				bpnode_inner<K,V>* s) noexcept {
 	int i;
 	bpnode_inner<K,V>* p = dynamic_cast<bpnode_inner<K,V>*>(n->parent);
@@ -759,10 +1570,11 @@ void bptree<K,V>::inner_borrow_right(bpnode_inner<K,V>* n,
 	s->keys.erase(s->keys.begin());
 	s->children.erase(s->children.begin());
 	s->num_keys--;
+	buffer_split(s, n, p->keys[i], false);
 }
 
-template <typename K, typename V>
-bpnode_inner<K,V>* bptree<K,V>::inner_merge_left(bpnode_inner<K,V>* n,
+template <typename K, typename V, typename C>
+bpnode_inner<K,V>* bptree<K,V,C>::inner_merge_left(bpnode_inner<K,V>* n,
 				bpnode_inner<K,V>* s) noexcept {
 	int i;
 	bpnode_inner<K,V>* p = dynamic_cast<bpnode_inner<K,V>*>(n->parent);
@@ -783,15 +1595,832 @@ bpnode_inner<K,V>* bptree<K,V>::inner_merge_left(bpnode_inner<K,V>* n,
 	for (auto &c : s->children)
 		c->parent = s;
 	s->num_keys += n->num_keys + 1;
+	std::move(n->buffer.begin(), n->buffer.end(), std::back_inserter(s->buffer));
 
 	/* remove parent key i-1 */
 	p->keys.erase(p->keys.begin() + i - 1);
 	p->children.erase(p->children.begin() + i);
 	p->num_keys--;
 
-	delete n;
+	node_free(n);
 	return p;
 }
 
-#endif
+template <typename K, typename V, typename C>
+bpnode_leaf<K,V>* bptree<K,V,C>::first_leaf(bpnode<K,V>* n) const noexcept {
+	while (n->is_inner())
+		n = dynamic_cast<bpnode_inner<K,V>*>(n)->children.front();
+	return dynamic_cast<bpnode_leaf<K,V>*>(n);
+}
+
+template <typename K, typename V, typename C>
+bpnode_leaf<K,V>* bptree<K,V,C>::last_leaf(bpnode<K,V>* n) const noexcept {
+	while (n->is_inner())
+		n = dynamic_cast<bpnode_inner<K,V>*>(n)->children.back();
+	return dynamic_cast<bpnode_leaf<K,V>*>(n);
+}
+
+/* make children j and j+1 of p both hold at least min_limits keys, either
+ * by coalescing them into one node or by spreading keys evenly
+*/
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::rebalance_pair(bpnode_inner<K,V>* p, int j) noexcept {
+	int min_limits = (m - 1) / 2;
+	bpnode<K,V> *a = p->children[j], *b = p->children[j + 1];
+
+	if (a->num_keys >= min_limits && b->num_keys >= min_limits)
+		return;
+
+	if (a->is_leaf()) {
+		bpnode_leaf<K,V>* la = dynamic_cast<bpnode_leaf<K,V>*>(a);
+		bpnode_leaf<K,V>* lb = dynamic_cast<bpnode_leaf<K,V>*>(b);
+		int total = la->num_keys + lb->num_keys;
+		leaf_touch(la);
+		leaf_touch(lb);
+		if (total < m) {
+			la->keys.insert(la->keys.end(), lb->keys.begin(), lb->keys.end());
+			la->values.insert(la->values.end(),
+				std::make_move_iterator(lb->values.begin()),
+				std::make_move_iterator(lb->values.end()));
+			la->num_keys = total;
+			la->next = lb->next;
+			p->keys.erase(p->keys.begin() + j);
+			p->children.erase(p->children.begin() + j + 1);
+			p->num_keys--;
+			leaf_forget(lb);
+			node_free(lb);
+			return;
+		}
+
+		int k = total / 2;
+		if (la->num_keys > k) {
+			lb->keys.insert(lb->keys.begin(), la->keys.begin() + k, la->keys.end());
+			lb->values.insert(lb->values.begin(),
+				std::make_move_iterator(la->values.begin() + k),
+				std::make_move_iterator(la->values.end()));
+			la->keys.erase(la->keys.begin() + k, la->keys.end());
+			la->values.erase(la->values.begin() + k, la->values.end());
+		} else {
+			int d = k - la->num_keys;
+			la->keys.insert(la->keys.end(), lb->keys.begin(), lb->keys.begin() + d);
+			la->values.insert(la->values.end(),
+				std::make_move_iterator(lb->values.begin()),
+				std::make_move_iterator(lb->values.begin() + d));
+			lb->keys.erase(lb->keys.begin(), lb->keys.begin() + d);
+			lb->values.erase(lb->values.begin(), lb->values.begin() + d);
+		}
+		la->num_keys = k;
+		lb->num_keys = total - k;
+		p->keys[j] = separator(la->keys.back(), lb->keys[0]);
+		return;
+	}
+
+	/* inner nodes, parent key j is dragged down between them */
+	bpnode_inner<K,V>* ia = dynamic_cast<bpnode_inner<K,V>*>(a);
+	bpnode_inner<K,V>* ib = dynamic_cast<bpnode_inner<K,V>*>(b);
+	int total = ia->num_keys + ib->num_keys + 1;
+	ia->keys.push_back(p->keys[j]);
+	ia->keys.insert(ia->keys.end(), ib->keys.begin(), ib->keys.end());
+	ia->children.insert(ia->children.end(), ib->children.begin(), ib->children.end());
+	if (total < m) {
+		for (auto &c : ia->children)
+			c->parent = ia;
+		ia->num_keys = total;
+		p->keys.erase(p->keys.begin() + j);
+		p->children.erase(p->children.begin() + j + 1);
+		p->num_keys--;
+		node_free(ib);
+		return;
+	}
+
+	int k = total / 2;
+	p->keys[j] = ia->keys[k];
+	ib->keys.assign(ia->keys.begin() + k + 1, ia->keys.end());
+	ib->children.assign(ia->children.begin() + k + 1, ia->children.end());
+	ia->keys.erase(ia->keys.begin() + k, ia->keys.end());
+	ia->children.erase(ia->children.begin() + k + 1, ia->children.end());
+	for (auto &c : ia->children)
+		c->parent = ia;
+	for (auto &c : ib->children)
+		c->parent = ib;
+	ia->num_keys = k;
+	ib->num_keys = total - k - 1;
+}
+
+/* hang subtree b (height hb, all keys greater than ours) on the right of
+ * this tree. only the spine between the two heights is touched
+*/
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::join_right(bpnode<K,V>* b, int hb) noexcept {
+	if (b == nullptr)
+		return;
+	b->parent = nullptr;
+	if (root == nullptr) {
+		root = b;
+		depth = hb;
+		return;
+	}
+
+	bpnode_leaf<K,V>* l = last_leaf(root);
+	l->next = first_leaf(b);
+	K sep = separator(leaf_key(l, l->num_keys - 1), leaf_key(first_leaf(b), 0));
+
+	if (depth == hb) {
+		insert_inner_node(nullptr, sep, root, b);
+		bpnode_inner<K,V>* r = dynamic_cast<bpnode_inner<K,V>*>(root);
+		rebalance_pair(r, 0);
+		if (r->num_keys == 0) {
+			root = r->children[0];
+			root->parent = nullptr;
+			depth--;
+			node_free(r);
+		}
+		return;
+	}
+
+	bpnode_inner<K,V>* p;
+	if (depth > hb) {
+		bpnode<K,V>* x = root;
+		for (int h = depth; h > hb; h--)
+			x = dynamic_cast<bpnode_inner<K,V>*>(x)->children.back();
+		p = dynamic_cast<bpnode_inner<K,V>*>(x->parent);
+		p->keys.push_back(sep);
+		p->children.push_back(b);
+		p->num_keys++;
+		b->parent = p;
+		rebalance_pair(p, p->num_keys - 1);
+	} else {
+		bpnode<K,V>* y = b;
+		for (int h = hb; h > depth; h--)
+			y = dynamic_cast<bpnode_inner<K,V>*>(y)->children.front();
+		p = dynamic_cast<bpnode_inner<K,V>*>(y->parent);
+		p->keys.insert(p->keys.begin(), sep);
+		p->children.insert(p->children.begin(), root);
+		p->num_keys++;
+		root->parent = p;
+		rebalance_pair(p, 0);
+		root = b;
+		depth = hb;
+	}
+	inner_split_if_full(p);
+}
+
+/* hang subtree a (height ha, all keys less than ours) on the left */
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::join_left(bpnode<K,V>* a, int ha) noexcept {
+	bpnode<K,V>* b = root;
+	int hb = depth;
+
+	if (a == nullptr)
+		return;
+	root = a;
+	depth = ha;
+	root->parent = nullptr;
+	join_right(b, hb);
+}
+
+/* move all keys >= key into the empty tree right. the descent path is cut
+ * into left and right pieces which are then joined back bottom-up, which
+ * restructures only O(log n) nodes. nodes keep no subtree counts though,
+ * so the moved keys are counted by walking every leaf header of the right
+ * part: the whole split costs O(n/m) leaf visits
+*/
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::split_at(const K& key, bptree<K,V,C>& right) noexcept {
+	std::vector<std::pair<bpnode<K,V>*, int>> lefts, rights;
+	bpnode<K,V>* n;
+	int h;
+	bpmem_scope scope(mem);
+
+	assert(right.root == nullptr && right.m == m && right.mem == mem);
+	/* parked writes can reshape the tree, read it only after applying them */
+	flush();
+	n = root;
+	h = depth;
+	if (root == nullptr)
+		return;
+
+	while (n->is_inner()) {
+		bpnode_inner<K,V>* inner = dynamic_cast<bpnode_inner<K,V>*>(n);
+		int i = check_children_index_by_key(inner, key);
+		int nk = inner->num_keys;
+		bpnode<K,V>* next = inner->children[i];
+
+		/* right piece: children i+1.., keys i+1.. */
+		if (nk - i == 0) {
+			rights.emplace_back(nullptr, 0);
+		} else if (nk - i == 1) {
+			rights.emplace_back(inner->children[nk], h - 1);
+		} else {
+			bpnode_inner<K,V>* r = node_new<bpnode_inner<K,V>>();
+			r->keys.assign(inner->keys.begin() + i + 1, inner->keys.end());
+			r->children.assign(inner->children.begin() + i + 1,
+					inner->children.end());
+			r->num_keys = nk - i - 1;
+			for (auto &c : r->children)
+				c->parent = r;
+			rights.emplace_back(r, h);
+		}
+
+		/* left piece: children 0..i-1, keys 0..i-2, reuses the node */
+		if (i <= 1) {
+			lefts.emplace_back(i == 0 ? nullptr : inner->children[0],
+					h - 1);
+			node_free(inner);
+		} else {
+			inner->keys.erase(inner->keys.begin() + i - 1, inner->keys.end());
+			inner->children.erase(inner->children.begin() + i,
+					inner->children.end());
+			inner->num_keys = i - 1;
+			lefts.emplace_back(inner, h);
+		}
+		n = next;
+		h--;
+	}
+
+	bpnode_leaf<K,V>* leaf = dynamic_cast<bpnode_leaf<K,V>*>(n);
+	bpnode_leaf<K,V>* rleaf = nullptr;
+	int idx;
+	leaf_touch(leaf);
+	idx = leaf_lower(leaf, key);
+	if (idx < leaf->num_keys) {
+		rleaf = node_new<bpnode_leaf<K,V>>();
+		right.leaf_touch(rleaf);
+		rleaf->keys.assign(leaf->keys.begin() + idx, leaf->keys.end());
+		rleaf->values.assign(std::make_move_iterator(leaf->values.begin() + idx),
+			std::make_move_iterator(leaf->values.end()));
+		rleaf->num_keys = leaf->num_keys - idx;
+		rleaf->next = leaf->next;
+	}
+	if (idx > 0) {
+		leaf->keys.erase(leaf->keys.begin() + idx, leaf->keys.end());
+		leaf->values.erase(leaf->values.begin() + idx, leaf->values.end());
+		leaf->num_keys = idx;
+	} else {
+		leaf_forget(leaf);
+		node_free(leaf);
+		leaf = nullptr;
+	}
+
+	root = leaf;
+	depth = (leaf == nullptr) ? 0 : 1;
+	if (leaf != nullptr)
+		leaf->parent = nullptr;
+	for (int j = lefts.size() - 1; j >= 0; j--)
+		join_left(lefts[j].first, lefts[j].second);
+	if (root != nullptr)
+		last_leaf(root)->next = nullptr;
+
+	right.root = rleaf;
+	right.depth = (rleaf == nullptr) ? 0 : 1;
+	if (rleaf != nullptr)
+		rleaf->parent = nullptr;
+	for (int j = rights.size() - 1; j >= 0; j--)
+		right.join_right(rights[j].first, rights[j].second);
+
+	right.count = 0;
+	for (bpnode<K,V>* l = (right.root ? right.first_leaf(right.root) : nullptr);
+			l != nullptr; l = dynamic_cast<bpnode_leaf<K,V>*>(l)->next)
+		right.count += l->num_keys;
+	count -= right.count;
+	pack_touched();
+	right.pack_touched();
+	validate_path(key, validate);
+	right.validate_path(key, validate);
+}
+
+/* append other to this tree, the key ranges must not overlap. other is
+ * left empty. returns false (and changes nothing) on overlap
+*/
+template <typename K, typename V, typename C>
+bool bptree<K,V,C>::join(bptree<K,V,C>& other) noexcept {
+	bpmem_scope scope(mem);
+
+	assert(other.m == m && other.mem == mem);
+	flush();
+	other.flush();
+	if (other.root == nullptr)
+		return true;
+
+	bpnode_leaf<K,V>* l;
+	bool after;
+	if (root == nullptr || (l = last_leaf(root), cmp(leaf_key(l, l->num_keys - 1),
+			leaf_key(first_leaf(other.root), 0))))
+		after = true;
+	else if (l = last_leaf(other.root), cmp(leaf_key(l, l->num_keys - 1),
+			leaf_key(first_leaf(root), 0)))
+		after = false;
+	else
+		return false;
+
+	/* nodes only change along the seam, the path of the upper part's first key */
+	K seam = leaf_key(first_leaf(after ? other.root : root), 0);
+	if (after)
+		join_right(other.root, other.depth);
+	else
+		join_left(other.root, other.depth);
+	pack_touched();
+	validate_path(seam, validate);
+
+	count += other.count;
+	other.root = nullptr;
+	other.depth = 0;
+	other.count = 0;
+	return true;
+}
+
+/* free the inner levels under n, level by level, leaves are kept */
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::destroy_inner(bpnode<K,V>* n) noexcept {
+	std::vector<bpnode_inner<K,V>*> level, next;
+
+	if (n->is_inner())
+		level.push_back(dynamic_cast<bpnode_inner<K,V>*>(n));
+	while (!level.empty()) {
+		for (auto &nn : level) {
+			for (bpnode<K,V>* &c : nn->children) {
+				if (c->is_inner())
+					next.push_back(dynamic_cast<bpnode_inner<K,V>*>(c));
+			}
+			node_free(nn);
+		}
+		level.swap(next);
+		next.clear();
+	}
+}
+
+/* key and value are moved in when passed as rvalues */
+template <typename K, typename V, typename C>
+template <typename KK, typename VV>
+void bptree<K,V,C>::bulk_append(std::vector<bpnode_leaf<K,V>*>& leaves,
+			KK&& key, VV&& value) noexcept {
+	if (leaves.empty() || leaves.back()->num_keys == m - 1) {
+		bpnode_leaf<K,V>* n = node_new<bpnode_leaf<K,V>>();
+		if (!leaves.empty())
+			leaves.back()->next = n;
+		leaves.push_back(n);
+	}
+	bpnode_leaf<K,V>* n = leaves.back();
+	n->keys.push_back(std::forward<KK>(key));
+	n->values.push_back(std::forward<VV>(value));
+	n->num_keys++;
+}
+
+/* build the inner levels on top of a linked run of packed leaves,
+ * children are spread evenly so every node stays above min_limits
+*/
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::bulk_finish(std::vector<bpnode_leaf<K,V>*>& leaves) noexcept {
+	int min_limits = (m - 1) / 2;
+
+	if (leaves.empty()) {
+		root = nullptr;
+		depth = 0;
+		return;
+	}
 
+	if (leaves.size() > 1 && leaves.back()->num_keys < min_limits) {
+		bpnode_leaf<K,V> *s = leaves[leaves.size() - 2], *n = leaves.back();
+		int d = min_limits - n->num_keys;
+		n->keys.insert(n->keys.begin(), s->keys.end() - d, s->keys.end());
+		n->values.insert(n->values.begin(),
+			std::make_move_iterator(s->values.end() - d),
+			std::make_move_iterator(s->values.end()));
+		s->keys.erase(s->keys.end() - d, s->keys.end());
+		s->values.erase(s->values.end() - d, s->values.end());
+		n->num_keys += d;
+		s->num_keys -= d;
+	}
+
+	std::vector<bpnode<K,V>*> level(leaves.begin(), leaves.end());
+	std::vector<K> mins;
+	mins.push_back(leaves[0]->keys[0]);
+	for (size_t i = 1; i < leaves.size(); i++)
+		mins.push_back(separator(leaves[i - 1]->keys.back(), leaves[i]->keys[0]));
+	depth = 1;
+
+	while (level.size() > 1) {
+		std::vector<bpnode<K,V>*> up;
+		std::vector<K> up_mins;
+		size_t groups = (level.size() + m - 1) / m;
+		size_t pos = 0;
+		for (size_t g = 0; g < groups; g++) {
+			size_t cnt = level.size() / groups + (g < level.size() % groups);
+			bpnode_inner<K,V>* n = node_new<bpnode_inner<K,V>>();
+			n->children.assign(level.begin() + pos, level.begin() + pos + cnt);
+			n->keys.assign(mins.begin() + pos + 1, mins.begin() + pos + cnt);
+			n->num_keys = cnt - 1;
+			for (auto &c : n->children)
+				c->parent = n;
+			up.push_back(n);
+			up_mins.push_back(mins[pos]);
+			pos += cnt;
+		}
+		level.swap(up);
+		mins.swap(up_mins);
+		depth++;
+	}
+	root = level[0];
+	root->parent = nullptr;
+
+	if (compress) {
+		for (auto &l : leaves)
+			leaf_pack(l);
+	}
+}
+
+/* fold other into this tree with one sequential pass over both leaf
+ * chains, values from other win on equal keys. the result is a freshly
+ * packed tree, other is left empty
+*/
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::merge(bptree<K,V,C>& other) noexcept {
+	bpmem_scope scope(mem);
+
+	assert(other.m == m && other.mem == mem);
+	flush();
+	other.flush();
+	if (other.root == nullptr)
+		return;
+	if (root == nullptr) {
+		std::swap(root, other.root);
+		std::swap(depth, other.depth);
+		std::swap(count, other.count);
+		return;
+	}
+
+	bpnode_leaf<K,V>* a = first_leaf(root);
+	bpnode_leaf<K,V>* b = first_leaf(other.root);
+	int ia = 0, ib = 0;
+	std::vector<bpnode_leaf<K,V>*> leaves;
+
+	/* only leaves are needed from here on, drop the old inner levels */
+	destroy_inner(root);
+	destroy_inner(other.root);
+	count = 0;
+	leaf_unpack(a);
+	leaf_unpack(b);
+
+	/* every pair is moved out, its source leaf is freed right after */
+	while (a != nullptr || b != nullptr) {
+		if (b == nullptr || (a != nullptr && cmp(a->keys[ia], b->keys[ib]))) {
+			bulk_append(leaves, std::move(a->keys[ia]), std::move(a->values[ia]));
+			ia++;
+		} else {
+			if (a != nullptr && !cmp(b->keys[ib], a->keys[ia]))
+				ia++;
+			bulk_append(leaves, std::move(b->keys[ib]), std::move(b->values[ib]));
+			ib++;
+		}
+		count++;
+
+		if (a != nullptr && ia == a->num_keys) {
+			bpnode_leaf<K,V>* t = a;
+			a = dynamic_cast<bpnode_leaf<K,V>*>(a->next);
+			ia = 0;
+			node_free(t);
+			if (a != nullptr)
+				leaf_unpack(a);
+		}
+		if (b != nullptr && ib == b->num_keys) {
+			bpnode_leaf<K,V>* t = b;
+			b = dynamic_cast<bpnode_leaf<K,V>*>(b->next);
+			ib = 0;
+			node_free(t);
+			if (b != nullptr)
+				leaf_unpack(b);
+		}
+	}
+
+	bulk_finish(leaves);
+	other.root = nullptr;
+	other.depth = 0;
+	other.count = 0;
+	if (validate)
+		check_sampled(validate);
+}
+
+/* park writes in inner node buffers of up to cap messages and push them
+ * down in batches, so a leaf is visited once for many writes. 0 flushes
+ * everything and goes back to direct writes. while writes are parked,
+ * get_count() only covers the applied ones and scans need a flush() first
+*/
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::set_write_buffer(size_t cap) noexcept {
+	if (cap == 0)
+		flush();
+	buffer_cap = cap;
+}
+
+/* apply every parked write. the highest message of a key is the newest,
+ * so messages are gathered top-down and the first one per key is kept
+*/
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::flush() noexcept {
+	if (pending == 0)
+		return;
+
+	bpmem_scope scope(mem);
+	std::vector<bpmsg<K,V>> msgs;
+	std::vector<bpnode_inner<K,V>*> level, next;
+	level.push_back(dynamic_cast<bpnode_inner<K,V>*>(root));
+	while (!level.empty()) {
+		for (auto &n : level) {
+			std::move(n->buffer.begin(), n->buffer.end(), std::back_inserter(msgs));
+			n->buffer.clear();
+			for (bpnode<K,V>* &c : n->children) {
+				if (c->is_inner())
+					next.push_back(dynamic_cast<bpnode_inner<K,V>*>(c));
+			}
+		}
+		level.swap(next);
+		next.clear();
+	}
+	pending = 0;
+
+	auto less = [this](const bpmsg<K,V>& a, const bpmsg<K,V>& b) {
+		return cmp(a.key, b.key);
+	};
+	std::stable_sort(msgs.begin(), msgs.end(), less);
+	size_t w = 0;
+	for (size_t i = 0; i < msgs.size(); i++) {
+		if (w == 0 || less(msgs[w - 1], msgs[i]))
+			msgs[w++] = std::move(msgs[i]);
+	}
+	apply_sorted(msgs.data(), w);
+}
+
+/* apply messages sorted by key, one per key, with one descent per run of
+ * keys that route to the same leaf
+*/
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::apply_sorted(bpmsg<K,V>* msgs, size_t nmsgs) noexcept {
+	for (size_t i = 0; i < nmsgs; ) {
+		if (root == nullptr) {
+			apply_msg(msgs[i++]);
+			continue;
+		}
+		const K* hi;
+		bpnode_leaf<K,V>* n = leaf_bound(msgs[i].key, hi);
+		size_t e = i + 1;
+		while (e < nmsgs && (hi == nullptr || cmp(msgs[e].key, *hi)))
+			e++;
+		leaf_apply_batch(n, msgs + i, e - i);
+		i = e;
+	}
+}
+
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::apply_msg(const bpmsg<K,V>& msg) noexcept {
+	if (msg.erase)
+		apply_delete(msg.key);
+	else
+		apply_insert(msg.key, msg.value);
+}
+
+/* apply messages sorted by key, one per key and all routing to leaf n, in
+ * one merge pass over the leaf. the leaf is split or rebalanced once
+ * afterwards instead of once per message
+*/
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::leaf_apply_batch(bpnode_leaf<K,V>* n, bpmsg<K,V>* msgs,
+			size_t nmsgs) noexcept {
+	bpvec<K> keys;
+	bpvec<V> values;
+	int i = 0;
+
+	leaf_touch(n);
+	keys.reserve(std::max<size_t>(m, n->num_keys + nmsgs));
+	values.reserve(std::max<size_t>(m, n->num_keys + nmsgs));
+	for (size_t j = 0; j < nmsgs; j++) {
+		bpmsg<K,V>& msg = msgs[j];
+		while (i < n->num_keys && cmp(n->keys[i], msg.key)) {
+			keys.push_back(std::move(n->keys[i]));
+			values.push_back(std::move(n->values[i]));
+			i++;
+		}
+		bool hit = i < n->num_keys && !cmp(msg.key, n->keys[i]);
+		if (hit)
+			i++;
+		if (msg.erase) {
+			count -= hit;
+			continue;
+		}
+		count += !hit;
+		keys.push_back(msg.key);
+		values.push_back(std::move(msg.value));
+	}
+	std::move(n->keys.begin() + i, n->keys.end(), std::back_inserter(keys));
+	std::move(n->values.begin() + i, n->values.end(), std::back_inserter(values));
+	n->keys.swap(keys);
+	n->values.swap(values);
+	n->num_keys = n->keys.size();
+
+	leaf_settle(n);
+	pack_touched();
+	validate_path(msgs[0].key, validate);
+	validate_path(msgs[nmsgs - 1].key, validate);
+}
+
+/* bring a leaf of any size back within [(m - 1) / 2, m - 1] keys: an
+ * overfull leaf is cut into evenly filled leaves, an underfull one is
+ * merged with a sibling and split again if that overflows
+*/
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::leaf_settle(bpnode_leaf<K,V>* n) noexcept {
+	int min_limits = (m - 1) / 2;
+
+	if (n->num_keys >= m) {
+		int parts = (n->num_keys + m - 2) / (m - 1);
+		int base = n->num_keys / parts, extra = n->num_keys % parts;
+
+		/* cut from the tail, each new leaf goes right after n */
+		for (int p = parts - 1; p > 0; p--) {
+			int size = base + (p < extra);
+			int k = n->num_keys - size;
+			bpnode_leaf<K,V>* s = node_new<bpnode_leaf<K,V>>();
+			leaf_touch(s);
+			s->keys.insert(s->keys.end(), n->keys.begin() + k, n->keys.end());
+			s->values.insert(s->values.end(),
+				std::make_move_iterator(n->values.begin() + k),
+				std::make_move_iterator(n->values.end()));
+			n->keys.erase(n->keys.begin() + k, n->keys.end());
+			n->values.erase(n->values.begin() + k, n->values.end());
+			s->num_keys = size;
+			n->num_keys = k;
+			s->parent = n->parent;
+			s->next = n->next;
+			n->next = s;
+			insert_inner_node(dynamic_cast<bpnode_inner<K,V>*>(n->parent),
+				separator(n->keys.back(), s->keys[0]), n, s);
+		}
+		return;
+	}
+
+	if (n->parent == nullptr) {
+		/* the root leaf may hold anything but nothing */
+		if (n->num_keys == 0) {
+			leaf_forget(n);
+			node_free(n);
+			root = nullptr;
+			depth = 0;
+		}
+		return;
+	}
+	if (n->num_keys >= min_limits)
+		return;
+
+	bpnode<K,V> *left, *right;
+	bpnode_leaf<K,V>* merged;
+	bpnode_inner<K,V>* p;
+	get_sibling(n, &left, &right);
+	if (left != nullptr) {
+		merged = dynamic_cast<bpnode_leaf<K,V>*>(left);
+		leaf_touch(merged);
+		p = leaf_merge_left(n, merged);
+	} else {
+		merged = n;
+		leaf_touch(dynamic_cast<bpnode_leaf<K,V>*>(right));
+		p = leaf_merge_right(n, dynamic_cast<bpnode_leaf<K,V>*>(right));
+	}
+	/* the sibling had at least min_limits keys, at most one split is due
+	 * and it leaves p with its old key count
+	*/
+	leaf_split_if_full(merged);
+	check_inner_node_size(p);
+}
+
+/* the message parked in n for key, nullptr if there is none */
+template <typename K, typename V, typename C>
+const bpmsg<K,V>* bptree<K,V,C>::buffer_find(const bpnode_inner<K,V>* n,
+			const K& key) const noexcept {
+	auto it = std::lower_bound(n->buffer.begin(), n->buffer.end(), key,
+		[this](const bpmsg<K,V>& a, const K& b) { return cmp(a.key, b); });
+	if (it == n->buffer.end() || cmp(key, it->key))
+		return nullptr;
+	return &*it;
+}
+
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::buffer_put(bpnode_inner<K,V>* n, const bpmsg<K,V>& msg) noexcept {
+	auto it = std::lower_bound(n->buffer.begin(), n->buffer.end(), msg.key,
+		[this](const bpmsg<K,V>& a, const K& b) { return cmp(a.key, b); });
+	if (it != n->buffer.end() && !cmp(msg.key, it->key)) {
+		*it = msg;
+		return;
+	}
+	n->buffer.insert(it, msg);
+	pending++;
+}
+
+/* merge a batch from above into n's buffer, the batch is newer and wins */
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::buffer_merge(bpnode_inner<K,V>* n,
+			bpvec<bpmsg<K,V>>& batch) noexcept {
+	bpvec<bpmsg<K,V>> out;
+	auto a = n->buffer.begin(), b = batch.begin();
+
+	out.reserve(n->buffer.size() + batch.size());
+	while (a != n->buffer.end() && b != batch.end()) {
+		if (cmp(a->key, b->key)) {
+			out.push_back(std::move(*a++));
+		} else {
+			if (!cmp(b->key, a->key)) {
+				a++;
+				pending--;
+			}
+			out.push_back(std::move(*b++));
+		}
+	}
+	std::move(a, n->buffer.end(), std::back_inserter(out));
+	std::move(b, batch.end(), std::back_inserter(out));
+	n->buffer.swap(out);
+}
+
+/* after keys moved between siblings, move the messages that followed
+ * them: upper takes from's keys >= key to the head of to, otherwise
+ * from's keys < key go to the tail of to
+*/
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::buffer_split(bpnode_inner<K,V>* from, bpnode_inner<K,V>* to,
+			const K& key, bool upper) noexcept {
+	auto it = std::lower_bound(from->buffer.begin(), from->buffer.end(), key,
+		[this](const bpmsg<K,V>& a, const K& b) { return cmp(a.key, b); });
+	if (upper) {
+		to->buffer.insert(to->buffer.begin(), std::make_move_iterator(it),
+			std::make_move_iterator(from->buffer.end()));
+		from->buffer.erase(it, from->buffer.end());
+	} else {
+		to->buffer.insert(to->buffer.end(), std::make_move_iterator(from->buffer.begin()),
+			std::make_move_iterator(it));
+		from->buffer.erase(from->buffer.begin(), it);
+	}
+}
+
+/* move the largest group of n's messages that share a child one level
+ * down. returns the child if its buffer overflowed in turn. over leaves
+ * the whole buffer is applied instead, one merge pass per touched leaf,
+ * and nullptr is returned as that may reshape the tree above
+*/
+template <typename K, typename V, typename C>
+bpnode_inner<K,V>* bptree<K,V,C>::flush_batch(bpnode_inner<K,V>* n) noexcept {
+	size_t i = 0, best_lo = 0, best_n = 0;
+	int j = 0, best = 0;
+
+	if (n->children[0]->is_leaf()) {
+		bpvec<bpmsg<K,V>> batch(std::make_move_iterator(n->buffer.begin()),
+			std::make_move_iterator(n->buffer.end()));
+		n->buffer.clear();
+		pending -= batch.size();
+		/* leaves below n can merge away, route from the root again */
+		apply_sorted(batch.data(), batch.size());
+
+		/* a collapsed root leaves its messages behind, the root is a leaf now */
+		while (!orphans.empty()) {
+			bpmsg<K,V> msg = std::move(orphans.back());
+			orphans.pop_back();
+			apply_msg(msg);
+		}
+		return nullptr;
+	}
+
+	while (i < n->buffer.size()) {
+		while (j < n->num_keys && !cmp(n->buffer[i].key, n->keys[j]))
+			j++;
+		size_t e = i + 1;
+		while (e < n->buffer.size() &&
+				(j == n->num_keys || cmp(n->buffer[e].key, n->keys[j])))
+			e++;
+		if (e - i > best_n) {
+			best = j;
+			best_lo = i;
+			best_n = e - i;
+		}
+		i = e;
+	}
+
+	auto lo = n->buffer.begin() + best_lo;
+	bpvec<bpmsg<K,V>> batch(std::make_move_iterator(lo),
+		std::make_move_iterator(lo + best_n));
+	n->buffer.erase(lo, lo + best_n);
+
+	bpnode_inner<K,V>* c = dynamic_cast<bpnode_inner<K,V>*>(n->children[best]);
+	buffer_merge(c, batch);
+	return c->buffer.size() > buffer_cap ? c : nullptr;
+}
+
+/* push messages down from the root until no buffer on the way is over
+ * the cap, restarting from the root whenever a leaf was written
+*/
+template <typename K, typename V, typename C>
+void bptree<K,V,C>::flush_path() noexcept {
+	while (root != nullptr && root->is_inner()) {
+		bpnode_inner<K,V>* n = dynamic_cast<bpnode_inner<K,V>*>(root);
+		if (n->buffer.size() <= buffer_cap)
+			break;
+		while (n != nullptr)
+			n = flush_batch(n);
+	}
+}
+
+#endif
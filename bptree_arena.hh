@@ -0,0 +1,178 @@
+/*
+ * B+ tree with out of line values
+ *
+ * Values are serialized into one append-only byte arena per tree and the
+ * leaves only hold their 8 byte offsets, so splits, merges and borrows
+ * move handles instead of copying heap owning values. Overwrites and
+ * deletes leave dead records behind, the arena is compacted (in key
+ * order) once they pass a share of its size.
+*/
+#ifndef BPTREE_ARENA_HH___
+#define BPTREE_ARENA_HH___
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <type_traits>
+#include <stdexcept>
+#include "bptree.hh"
+
+/* how a value is laid out in the arena, plain copies for trivially
+ * copyable types
+*/
+template <typename V>
+struct bpvalue_traits {
+	static_assert(std::is_trivially_copyable<V>::value,
+		"bpvalue_traits needs a specialization for this type");
+	static size_t size(const V& v) noexcept { return sizeof(V); }
+	static void store(const V& v, char* p) noexcept { memcpy(p, &v, sizeof(V)); }
+	static void load(const char* p, size_t n, V& v) noexcept { memcpy(&v, p, sizeof(V)); }
+};
+
+template <>
+struct bpvalue_traits<std::string> {
+	static size_t size(const std::string& v) noexcept { return v.size(); }
+	static void store(const std::string& v, char* p) noexcept {
+		memcpy(p, v.data(), v.size());
+	}
+	static void load(const char* p, size_t n, std::string& v) { v.assign(p, n); }
+};
+
+template <typename K, typename V, typename C = std::less<K>>
+class bptree_arena {
+protected:
+	/* a record is a uint32_t length followed by the value bytes */
+	bptree<K, uint64_t, C> tree;
+	std::vector<char> arena;
+	uint64_t dead;
+	double max_dead;
+
+public:
+	bptree_arena(int m_, double max_dead_ = 0.5) :
+		tree{m_}, dead{0}, max_dead{max_dead_} {}
+	uint64_t get_count() const noexcept { return tree.get_count(); }
+	int get_depth() const noexcept { return tree.get_depth(); }
+	size_t get_arena_bytes() const noexcept { return arena.size(); }
+	uint64_t get_dead_bytes() const noexcept { return dead; }
+	bool find_key(const K& key, V& value) const;
+	void insert_key(const K& key, const V& value);
+	bool delete_key(const K& key);
+	template <typename F> bool scan_range(const K& from, const K& to, F fn) const;
+	void compact();
+	void check() const noexcept { tree.check(); }
+
+private:
+	uint32_t record_len(uint64_t h) const noexcept;
+	uint64_t append(const V& value);
+	void retire(uint64_t h);
+	void load(uint64_t h, V& value) const;
+};
+
+template <typename K, typename V, typename C>
+uint32_t bptree_arena<K,V,C>::record_len(uint64_t h) const noexcept {
+	uint32_t n;
+	memcpy(&n, arena.data() + h, sizeof(n));
+	return n;
+}
+
+/* a record length is 32 bits, larger values are refused before anything
+ * is written
+*/
+template <typename K, typename V, typename C>
+uint64_t bptree_arena<K,V,C>::append(const V& value) {
+	size_t size = bpvalue_traits<V>::size(value);
+	uint32_t n = size;
+	uint64_t h = arena.size();
+
+	if (size > UINT32_MAX)
+		throw std::length_error("bptree_arena: value of 4 GiB or more");
+	arena.resize(h + sizeof(n) + n);
+	memcpy(arena.data() + h, &n, sizeof(n));
+	bpvalue_traits<V>::store(value, arena.data() + h + sizeof(n));
+	return h;
+}
+
+template <typename K, typename V, typename C>
+void bptree_arena<K,V,C>::retire(uint64_t h) {
+	dead += sizeof(uint32_t) + record_len(h);
+	if (dead > 4096 && dead > max_dead * arena.size())
+		compact();
+}
+
+template <typename K, typename V, typename C>
+void bptree_arena<K,V,C>::load(uint64_t h, V& value) const {
+	bpvalue_traits<V>::load(arena.data() + h + sizeof(uint32_t), record_len(h), value);
+}
+
+/* value is copied out, the arena may move on the next write */
+template <typename K, typename V, typename C>
+bool bptree_arena<K,V,C>::find_key(const K& key, V& value) const {
+	uint64_t* h;
+
+	if (!tree.find_key(key, h))
+		return false;
+	load(*h, value);
+	return true;
+}
+
+/* throws std::length_error for a value of 4 GiB or more, the tree and
+ * the arena are left as they were
+*/
+template <typename K, typename V, typename C>
+void bptree_arena<K,V,C>::insert_key(const K& key, const V& value) {
+	uint64_t* h;
+
+	if (tree.find_key(key, h)) {
+		uint64_t old = *h;
+		*h = append(value);
+		retire(old);
+		return;
+	}
+	tree.insert_key(key, append(value));
+}
+
+template <typename K, typename V, typename C>
+bool bptree_arena<K,V,C>::delete_key(const K& key) {
+	uint64_t* h;
+
+	if (!tree.find_key(key, h))
+		return false;
+	uint64_t old = *h;
+	tree.delete_key(key);
+	retire(old);
+	return true;
+}
+
+/* call fn(key, value) for every key in [from, to) in order, stop as soon
+ * as fn returns false. returns false if stopped by fn
+*/
+template <typename K, typename V, typename C>
+template <typename F>
+bool bptree_arena<K,V,C>::scan_range(const K& from, const K& to, F fn) const {
+	V value;
+	return tree.scan_range(from, to, [&](const K& k, const uint64_t& h) {
+		load(h, value);
+		return fn(k, value);
+	});
+}
+
+/* copy the live records into a fresh arena in key order, so a range scan
+ * reads the arena front to back
+*/
+template <typename K, typename V, typename C>
+void bptree_arena<K,V,C>::compact() {
+	std::vector<char> fresh;
+
+	fresh.reserve(arena.size() - dead);
+	tree.update_all([&](const K& k, uint64_t& h) {
+		uint64_t off = fresh.size();
+		size_t n = sizeof(uint32_t) + record_len(h);
+		fresh.insert(fresh.end(), arena.begin() + h, arena.begin() + h + n);
+		h = off;
+		return true;
+	});
+	arena.swap(fresh);
+	dead = 0;
+}
+
+#endif
@@ -0,0 +1,173 @@
+/*
+ * Frozen, read-only B+ tree
+ *
+ * All pairs sit in two dense arrays cut into blocks of B keys. The inner
+ * levels are one contiguous array of B-key nodes laid out level by level
+ * (CSS-tree style): the children of node j are nodes j*(B+1) .. j*(B+1)+B
+ * of the next level, so a descent does arithmetic instead of loading
+ * child pointers, and there are no parents, vtables or spare capacity.
+*/
+#ifndef BPTREE_FROZEN_HH___
+#define BPTREE_FROZEN_HH___
+
+#include <vector>
+#include <algorithm>
+#include "bptree.hh"
+
+template <typename K, typename V, typename C>
+class bptree_frozen {
+protected:
+	/* one node per cache line where the key type allows it */
+	static constexpr int B = (64 / sizeof(K) < 4) ? 4 : 64 / sizeof(K);
+
+	std::vector<K> keys;
+	std::vector<V> values;
+	/* inner nodes, B keys each, root level first */
+	std::vector<K> inner;
+	/* first node and node count of every inner level, root level first */
+	std::vector<std::pair<size_t, size_t>> levels;
+	size_t blocks;
+	C cmp;
+
+public:
+	explicit bptree_frozen(bptree<K,V,C>& t);
+	uint64_t get_count() const noexcept { return keys.size(); }
+	int get_depth() const noexcept { return levels.size() + 1; }
+	size_t get_memory() const noexcept;
+	bool find_key(const K& key, const V*& value) const noexcept;
+	size_t lower_bound(const K& key) const noexcept;
+	const K& key_at(size_t i) const noexcept { return keys[i]; }
+	const V& value_at(size_t i) const noexcept { return values[i]; }
+	template <typename F> bool scan_range(const K& from, const K& to, F fn) const;
+	void thaw(bptree<K,V,C>& out) const noexcept;
+
+private:
+	void build() noexcept;
+};
+
+/* parked writes of a buffered tree are applied first, see bptree::flush() */
+template <typename K, typename V, typename C>
+bptree_frozen<K,V,C>::bptree_frozen(bptree<K,V,C>& t) : blocks{0}, cmp{t.cmp} {
+	t.flush();
+	keys.reserve(t.get_count());
+	values.reserve(t.get_count());
+	t.scan_all([&](const K& k, const V& v) {
+		keys.push_back(k);
+		values.push_back(v);
+		return true;
+	});
+	build();
+}
+
+template <typename K, typename V, typename C>
+bptree_frozen<K,V,C> bptree<K,V,C>::freeze() {
+	return bptree_frozen<K,V,C>(*this);
+}
+
+/* key i of node j separates its children i and i+1, it is the first key
+ * under child i+1. keys past the last child of a level's last node are
+ * padded with the largest key, descents clamp to the last real child
+*/
+template <typename K, typename V, typename C>
+void bptree_frozen<K,V,C>::build() noexcept {
+	std::vector<size_t> sizes;
+
+	blocks = (keys.size() + B - 1) / B;
+	for (size_t n = blocks; n > 1; ) {
+		n = (n + B) / (B + 1);
+		sizes.push_back(n);
+	}
+
+	size_t off = 0;
+	for (size_t l = sizes.size(); l-- > 0; ) {
+		levels.push_back(std::make_pair(off, sizes[l]));
+		off += sizes[l];
+	}
+	inner.resize(off * B, keys.empty() ? K() : keys.back());
+
+	/* span: leaf blocks under one child of the level being filled */
+	size_t span = 1, below = blocks;
+	for (size_t l = levels.size(); l-- > 0; ) {
+		K* nodes = inner.data() + levels[l].first * B;
+		for (size_t j = 0; j < levels[l].second; j++) {
+			for (int i = 0; i < B; i++) {
+				size_t c = j * (B + 1) + i + 1;
+				if (c < below)
+					nodes[j * B + i] = keys[c * span * B];
+			}
+		}
+		below = levels[l].second;
+		span *= B + 1;
+	}
+}
+
+template <typename K, typename V, typename C>
+size_t bptree_frozen<K,V,C>::get_memory() const noexcept {
+	return keys.capacity() * sizeof(K) + values.capacity() * sizeof(V) +
+		inner.capacity() * sizeof(K) +
+		levels.capacity() * sizeof(std::pair<size_t, size_t>);
+}
+
+/* index of the first key not less than key, get_count() if none */
+template <typename K, typename V, typename C>
+size_t bptree_frozen<K,V,C>::lower_bound(const K& key) const noexcept {
+	size_t j = 0;
+
+	if (keys.empty())
+		return 0;
+
+	for (size_t l = 0; l < levels.size(); l++) {
+		const K* node = inner.data() + (levels[l].first + j) * B;
+		size_t below = (l + 1 < levels.size()) ? levels[l + 1].second : blocks;
+		int c = 0;
+		for (int i = 0; i < B; i++)
+			c += !cmp(key, node[i]);
+		j = j * (B + 1) + c;
+		if (j >= below)
+			j = below - 1;
+	}
+
+	auto lo = keys.begin() + j * B;
+	auto hi = keys.begin() + std::min(j * B + B, keys.size());
+	return std::lower_bound(lo, hi, key, cmp) - keys.begin();
+}
+
+template <typename K, typename V, typename C>
+bool bptree_frozen<K,V,C>::find_key(const K& key, const V*& value) const noexcept {
+	size_t i = lower_bound(key);
+
+	if (i == keys.size() || cmp(key, keys[i]))
+		return false;
+	value = &values[i];
+	return true;
+}
+
+/* call fn(key, value) for every key in [from, to) in order, stop as soon
+ * as fn returns false. returns false if stopped by fn
+*/
+template <typename K, typename V, typename C>
+template <typename F>
+bool bptree_frozen<K,V,C>::scan_range(const K& from, const K& to, F fn) const {
+	for (size_t i = lower_bound(from); i < keys.size() && cmp(keys[i], to); i++) {
+		if (!fn(keys[i], values[i]))
+			return false;
+	}
+	return true;
+}
+
+/* rebuild a mutable tree into the empty tree out, leaves are filled the
+ * same way merge() does it
+*/
+template <typename K, typename V, typename C>
+void bptree_frozen<K,V,C>::thaw(bptree<K,V,C>& out) const noexcept {
+	std::vector<bpnode_leaf<K,V>*> leaves;
+	bpmem_scope scope(out.mem);
+
+	assert(out.root == nullptr);
+	for (size_t i = 0; i < keys.size(); i++)
+		out.bulk_append(leaves, keys[i], values[i]);
+	out.bulk_finish(leaves);
+	out.count = keys.size();
+}
+
+#endif
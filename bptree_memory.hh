@@ -0,0 +1,308 @@
+/*
+ * Node memory for B+ trees
+ *
+ * A bpnode_memory hands out node headers and node arrays from a few large
+ * mmap regions instead of the general heap, so a big tree is covered by
+ * few (huge) pages and the descent misses the TLB less. Regions ask for
+ * hugepages and can be bound to, or interleaved across, NUMA nodes.
+ * Where no region can be mapped (no mmap, or the mapping is refused) the
+ * blocks come from the heap instead.
+*/
+#ifndef BPTREE_MEMORY_HH___
+#define BPTREE_MEMORY_HH___
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <utility>
+#include <algorithm>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define BPMEM_MMAP 1
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define BPMEM_HUGE_PAGE (2UL << 20)
+
+/* numaif.h is part of libnuma, the two policies needed are fixed ABI */
+#define BPMEM_MPOL_BIND 2
+#define BPMEM_MPOL_INTERLEAVE 3
+
+enum bpmem_policy {
+	BPMEM_LOCAL = 0,	/* first touch, the kernel default */
+	BPMEM_BIND,		/* only the nodes in the mask */
+	BPMEM_INTERLEAVE,	/* pages round robin over the nodes in the mask */
+};
+
+struct bpmem_stats {
+	size_t regions;		/* mmap regions */
+	size_t reserved;	/* bytes mapped */
+	size_t used;		/* bytes handed out and not freed */
+	size_t heap;		/* part of used that came from the heap */
+	size_t huge;		/* bytes the kernel backs with hugepages */
+	size_t pages;		/* pages covering reserved, i.e. TLB entries to map it all */
+	bool numa;		/* the NUMA policy was applied to every region */
+};
+
+class bpnode_memory {
+protected:
+	struct region {
+		char* addr;
+		size_t size;
+		bool hugetlb;
+	};
+
+	/* sorted by address */
+	std::vector<region> regions;
+	/* free blocks by size class (16 byte steps), linked through their head */
+	std::vector<void*> free_lists;
+	char* cur;
+	char* end;
+	size_t region_size;
+	size_t used;
+	size_t heap;
+	bool hugepages;
+	bpmem_policy policy;
+	unsigned long nodemask;
+	bool numa_ok;
+
+public:
+	bpnode_memory(bool hugepages_ = true, size_t region_size_ = 64UL << 20,
+		bpmem_policy policy_ = BPMEM_LOCAL, unsigned long nodemask_ = 0) :
+		cur{nullptr}, end{nullptr}, used{0}, heap{0}, hugepages{hugepages_},
+		policy{policy_}, nodemask{nodemask_}, numa_ok{true} {
+		region_size = (region_size_ + BPMEM_HUGE_PAGE - 1) & ~(BPMEM_HUGE_PAGE - 1);
+	}
+	bpnode_memory(const bpnode_memory&) = delete;
+	bpnode_memory& operator=(const bpnode_memory&) = delete;
+	~bpnode_memory();
+	void* allocate(size_t n);
+	void deallocate(void* p, size_t n) noexcept;
+	bool owns(const void* p) const noexcept;
+	bpmem_stats get_stats() const noexcept;
+
+private:
+	static size_t size_class(size_t n) noexcept { return (n + 15) / 16; }
+	bool map_region(size_t size) noexcept;
+};
+
+/* every tree using this memory has to be gone before it */
+inline bpnode_memory::~bpnode_memory() {
+#ifdef BPMEM_MMAP
+	for (auto &r : regions)
+		munmap(r.addr, r.size);
+#endif
+}
+
+/* reserve a region: explicit hugetlb pages first, then a 2 MiB aligned
+ * anonymous mapping marked for transparent hugepages, which the kernel
+ * may or may not honour
+*/
+inline bool bpnode_memory::map_region(size_t size) noexcept {
+#ifdef BPMEM_MMAP
+	char* p = (char*)MAP_FAILED;
+	bool hugetlb = false;
+
+#ifdef MAP_HUGETLB
+	if (hugepages) {
+		p = (char*)mmap(nullptr, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		hugetlb = p != (char*)MAP_FAILED;
+	}
+#endif
+	if (p == (char*)MAP_FAILED) {
+		/* over-map and trim so the region starts on a hugepage boundary */
+		char* raw = (char*)mmap(nullptr, size + BPMEM_HUGE_PAGE,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (raw == (char*)MAP_FAILED)
+			return false;
+		p = (char*)(((uintptr_t)raw + BPMEM_HUGE_PAGE - 1) & ~(BPMEM_HUGE_PAGE - 1));
+		if (p > raw)
+			munmap(raw, p - raw);
+		munmap(p + size, raw + BPMEM_HUGE_PAGE - p);
+#ifdef MADV_HUGEPAGE
+		madvise(p, size, hugepages ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+#endif
+	}
+
+	if (policy != BPMEM_LOCAL) {
+#ifdef SYS_mbind
+		int mode = (policy == BPMEM_BIND) ? BPMEM_MPOL_BIND : BPMEM_MPOL_INTERLEAVE;
+		if (syscall(SYS_mbind, p, size, mode, &nodemask,
+				sizeof(nodemask) * 8 + 1, 0) != 0)
+			numa_ok = false;
+#else
+		numa_ok = false;
+#endif
+	}
+
+	auto at = std::upper_bound(regions.begin(), regions.end(), p,
+		[](char* a, const region& r) { return a < r.addr; });
+	regions.insert(at, region{p, size, hugetlb});
+	cur = p;
+	end = p + size;
+	return true;
+#else
+	return false;
+#endif
+}
+
+inline bool bpnode_memory::owns(const void* p) const noexcept {
+	auto at = std::upper_bound(regions.begin(), regions.end(), (const char*)p,
+		[](const char* a, const region& r) { return a < r.addr; });
+	return at != regions.begin() && (const char*)p < (at - 1)->addr + (at - 1)->size;
+}
+
+/* 16 byte aligned. when no region can be mapped the block comes from the
+ * heap, so like new this only fails by throwing std::bad_alloc
+*/
+inline void* bpnode_memory::allocate(size_t n) {
+	size_t c = size_class(n ? n : 1);
+	size_t size = c * 16;
+
+	if (c < free_lists.size() && free_lists[c] != nullptr) {
+		void* p = free_lists[c];
+		free_lists[c] = *(void**)p;
+		used += size;
+		return p;
+	}
+
+	/* the tail of a full region is left unused */
+	if (cur == nullptr || (size_t)(end - cur) < size) {
+		size_t rs = size > region_size ?
+			(size + BPMEM_HUGE_PAGE - 1) & ~(BPMEM_HUGE_PAGE - 1) : region_size;
+		if (!map_region(rs)) {
+			void* p = ::operator new(size);
+			used += size;
+			heap += size;
+			return p;
+		}
+	}
+	void* p = cur;
+	cur += size;
+	used += size;
+	return p;
+}
+
+inline void bpnode_memory::deallocate(void* p, size_t n) noexcept {
+	size_t c = size_class(n ? n : 1);
+
+	if (p == nullptr)
+		return;
+	used -= c * 16;
+	if (!owns(p)) {
+		heap -= c * 16;
+		::operator delete(p);
+		return;
+	}
+	if (c >= free_lists.size())
+		free_lists.resize(c + 1, nullptr);
+	*(void**)p = free_lists[c];
+	free_lists[c] = p;
+}
+
+/* hugepage backing of transparent hugepage regions is only known to the
+ * kernel, it is read from /proc/self/smaps
+*/
+inline bpmem_stats bpnode_memory::get_stats() const noexcept {
+	bpmem_stats st = { regions.size(), 0, used, heap, 0, 0, numa_ok };
+#ifdef BPMEM_MMAP
+	size_t page = sysconf(_SC_PAGESIZE);
+#else
+	size_t page = 4096;
+#endif
+
+	for (auto &r : regions) {
+		st.reserved += r.size;
+		if (r.hugetlb)
+			st.huge += r.size;
+	}
+
+	std::ifstream f("/proc/self/smaps");
+	std::string line;
+	bool ours = false;
+	while (std::getline(f, line)) {
+		unsigned long lo, hi;
+		if (sscanf(line.c_str(), "%lx-%lx ", &lo, &hi) == 2) {
+			ours = false;
+			for (auto &r : regions) {
+				if (!r.hugetlb && lo < (uintptr_t)r.addr + r.size &&
+						(uintptr_t)r.addr < hi)
+					ours = true;
+			}
+			continue;
+		}
+		if (ours && line.compare(0, 14, "AnonHugePages:") == 0)
+			st.huge += strtoul(line.c_str() + 14, nullptr, 10) * 1024;
+	}
+
+	st.pages = st.huge / BPMEM_HUGE_PAGE + (st.reserved - st.huge) / page;
+	return st;
+}
+
+/* memory of the tree operation running on this thread, nullptr for the
+ * heap. node arrays are allocated from it, so the memory is kept once per
+ * tree instead of once per node array
+*/
+inline bpnode_memory*& bpmem_current() noexcept {
+	static thread_local bpnode_memory* cur = nullptr;
+	return cur;
+}
+
+/* makes mem current for the lifetime of the scope */
+struct bpmem_scope {
+	bpnode_memory* saved;
+
+	explicit bpmem_scope(bpnode_memory* mem) noexcept : saved{bpmem_current()} {
+		bpmem_current() = mem;
+	}
+	~bpmem_scope() { bpmem_current() = saved; }
+	bpmem_scope(const bpmem_scope&) = delete;
+	bpmem_scope& operator=(const bpmem_scope&) = delete;
+};
+
+/* stateless std allocator over the current bpnode_memory. a block has to
+ * be freed while the memory it came from is current again, every bptree
+ * operation that allocates or frees nodes makes its tree's memory current
+*/
+template <typename T>
+struct bpalloc {
+	typedef T value_type;
+
+	bpalloc() noexcept {}
+	template <typename U>
+	bpalloc(const bpalloc<U>&) noexcept {}
+
+	T* allocate(size_t n) {
+		bpnode_memory* mem = bpmem_current();
+		if (mem == nullptr)
+			return static_cast<T*>(::operator new(n * sizeof(T)));
+		return static_cast<T*>(mem->allocate(n * sizeof(T)));
+	}
+	void deallocate(T* p, size_t n) noexcept {
+		bpnode_memory* mem = bpmem_current();
+		if (mem == nullptr)
+			::operator delete(p);
+		else
+			mem->deallocate(p, n * sizeof(T));
+	}
+};
+
+template <typename T, typename U>
+bool operator==(const bpalloc<T>&, const bpalloc<U>&) noexcept { return true; }
+
+template <typename T, typename U>
+bool operator!=(const bpalloc<T>&, const bpalloc<U>&) noexcept { return false; }
+
+template <typename T>
+using bpvec = std::vector<T, bpalloc<T>>;
+
+#endif
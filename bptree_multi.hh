@@ -0,0 +1,197 @@
+/*
+ * Duplicate-key (multimap) B+ tree
+ *
+ * Every key is stored once in the tree, its values form a sorted posting
+ * list. Short lists live inline in the leaf entry, longer ones move out of
+ * line, so a heavy key costs one leaf slot however many values it has.
+*/
+#ifndef BPTREE_MULTI_HH___
+#define BPTREE_MULTI_HH___
+
+#include <vector>
+#include <algorithm>
+#include "bptree.hh"
+
+template <typename V, int N = 2>
+class bpposting {
+protected:
+	int32_t n;
+	V inl[N];		/* used while n <= N */
+	std::vector<V>* ext;	/* used once n > N */
+
+public:
+	bpposting() : n{0}, ext{nullptr} {}
+	explicit bpposting(const V& v) : n{1}, ext{nullptr} { inl[0] = v; }
+	bpposting(const bpposting& o) : n{o.n}, ext{nullptr} {
+		if (o.ext != nullptr)
+			ext = new std::vector<V>(*o.ext);
+		else
+			std::copy(o.inl, o.inl + n, inl);
+	}
+	bpposting(bpposting&& o) noexcept : n{o.n}, ext{o.ext} {
+		if (ext == nullptr)
+			std::move(o.inl, o.inl + n, inl);
+		o.n = 0;
+		o.ext = nullptr;
+	}
+	bpposting& operator=(const bpposting& o) {
+		if (this != &o) {
+			bpposting t(o);
+			*this = std::move(t);
+		}
+		return *this;
+	}
+	bpposting& operator=(bpposting&& o) noexcept {
+		if (this != &o) {
+			delete ext;
+			n = o.n;
+			ext = o.ext;
+			if (ext == nullptr)
+				std::move(o.inl, o.inl + n, inl);
+			o.n = 0;
+			o.ext = nullptr;
+		}
+		return *this;
+	}
+	~bpposting() { delete ext; }
+
+	int32_t size() const noexcept { return n; }
+	bool is_inline() const noexcept { return ext == nullptr; }
+	const V* begin() const noexcept { return ext ? ext->data() : inl; }
+	const V* end() const noexcept { return begin() + n; }
+	void insert(const V& v);
+	bool erase(const V& v) noexcept;
+};
+
+/* keep values sorted, a new value goes after its equals */
+template <typename V, int N>
+void bpposting<V,N>::insert(const V& v) {
+	if (ext == nullptr && n == N) {
+		ext = new std::vector<V>(inl, inl + n);
+		ext->reserve(2 * N + 1);
+	}
+	if (ext != nullptr) {
+		ext->insert(std::upper_bound(ext->begin(), ext->end(), v), v);
+		n++;
+		return;
+	}
+	V* pos = std::upper_bound(inl, inl + n, v);
+	std::move_backward(pos, inl + n, inl + n + 1);
+	*pos = v;
+	n++;
+}
+
+/* drop one occurrence of v, lists that shrink back to N go inline again */
+template <typename V, int N>
+bool bpposting<V,N>::erase(const V& v) noexcept {
+	if (ext != nullptr) {
+		auto it = std::lower_bound(ext->begin(), ext->end(), v);
+		if (it == ext->end() || v < *it)
+			return false;
+		ext->erase(it);
+		n--;
+		if (n <= N) {
+			std::move(ext->begin(), ext->end(), inl);
+			delete ext;
+			ext = nullptr;
+		}
+		return true;
+	}
+	V* it = std::lower_bound(inl, inl + n, v);
+	if (it == inl + n || v < *it)
+		return false;
+	std::move(it + 1, inl + n, it);
+	n--;
+	return true;
+}
+
+template <typename K, typename V, int N = 2>
+class bptree_multi {
+protected:
+	bptree<K, bpposting<V,N>> tree;
+	uint64_t count;
+
+public:
+	bptree_multi(int m_) : tree{m_}, count{0} {}
+	uint64_t get_count() const noexcept { return count; }
+	uint64_t get_keys() const noexcept { return tree.get_count(); }
+	int get_depth() const noexcept { return tree.get_depth(); }
+	void insert(const K& key, const V& value);
+	size_t count_key(const K& key) const noexcept;
+	template <typename F> bool for_each(const K& key, F fn) const;
+	template <typename F> bool scan_range(const K& from, const K& to, F fn) const;
+	bool erase(const K& key, const V& value) noexcept;
+	size_t erase_key(const K& key) noexcept;
+	void check() const noexcept { tree.check(); }
+};
+
+template <typename K, typename V, int N>
+void bptree_multi<K,V,N>::insert(const K& key, const V& value) {
+	bpposting<V,N>* p;
+
+	if (tree.find_key(key, p))
+		p->insert(value);
+	else
+		tree.insert_key(key, bpposting<V,N>(value));
+	count++;
+}
+
+template <typename K, typename V, int N>
+size_t bptree_multi<K,V,N>::count_key(const K& key) const noexcept {
+	bpposting<V,N>* p;
+	return tree.find_key(key, p) ? p->size() : 0;
+}
+
+/* call fn(value) for the values of key in order, stop when fn returns false */
+template <typename K, typename V, int N>
+template <typename F>
+bool bptree_multi<K,V,N>::for_each(const K& key, F fn) const {
+	bpposting<V,N>* p;
+
+	if (!tree.find_key(key, p))
+		return true;
+	for (const V& v : *p) {
+		if (!fn(v))
+			return false;
+	}
+	return true;
+}
+
+/* call fn(key, value) for every pair with a key in [from, to) */
+template <typename K, typename V, int N>
+template <typename F>
+bool bptree_multi<K,V,N>::scan_range(const K& from, const K& to, F fn) const {
+	return tree.scan_range(from, to, [&](const K& k, const bpposting<V,N>& p) {
+		for (const V& v : p) {
+			if (!fn(k, v))
+				return false;
+		}
+		return true;
+	});
+}
+
+template <typename K, typename V, int N>
+bool bptree_multi<K,V,N>::erase(const K& key, const V& value) noexcept {
+	bpposting<V,N>* p;
+
+	if (!tree.find_key(key, p) || !p->erase(value))
+		return false;
+	if (p->size() == 0)
+		tree.delete_key(key);
+	count--;
+	return true;
+}
+
+template <typename K, typename V, int N>
+size_t bptree_multi<K,V,N>::erase_key(const K& key) noexcept {
+	bpposting<V,N>* p;
+
+	if (!tree.find_key(key, p))
+		return 0;
+	size_t n = p->size();
+	tree.delete_key(key);
+	count -= n;
+	return n;
+}
+
+#endif
@@ -0,0 +1,241 @@
+/*
+ * Range-partitioned sharded B+ tree
+ *
+ * The key space is split into N partitions by a small sorted router array,
+ * each partition is an independent bptree with its own lock, so writers on
+ * different partitions never touch the same nodes. With node memory on,
+ * each partition also places its nodes in its own bpnode_memory, so the
+ * writers never share an allocator either.
+*/
+#ifndef BPTREE_SHARD_HH___
+#define BPTREE_SHARD_HH___
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <algorithm>
+#include "bptree.hh"
+#include "bptree_frozen.hh"
+
+template <typename K, typename V>
+class bptree_sharded {
+protected:
+	struct shard {
+		std::mutex lock;
+		/* nullptr for the heap, declared before tree so it outlives it */
+		std::unique_ptr<bpnode_memory> mem;
+		bptree<K,V> tree;
+		shard(int m_, bool node_memory) :
+				mem{node_memory ? new bpnode_memory() : nullptr}, tree{m_} {
+			tree.set_memory(mem.get());
+		}
+	};
+
+	/* shards[i] holds keys in [bounds[i - 1], bounds[i]) */
+	std::vector<K> bounds;
+	std::vector<std::unique_ptr<shard>> shards;
+	mutable std::shared_timed_mutex router_lock;
+	int m;
+	bool node_memory;
+
+public:
+	bptree_sharded(int m_, const std::vector<K>& bounds_ = std::vector<K>(),
+		bool node_memory_ = false);
+	size_t get_shards() const noexcept;
+	uint64_t get_count() const noexcept;
+	bool find_key(const K& key, V& value) const noexcept;
+	void insert_key(const K& key, const V& value) noexcept;
+	bool delete_key(const K& key) noexcept;
+	template <typename F> bool scan_range(const K& from, const K& to, F fn) const;
+	void rebalance(size_t nshards, double skew = 2.0) noexcept;
+	void dump_brief() const noexcept;
+
+private:
+	size_t route(const K& key) const noexcept;
+	void split_shard(size_t i) noexcept;
+	void merge_shards(size_t i) noexcept;
+};
+
+template <typename K, typename V>
+bptree_sharded<K,V>::bptree_sharded(int m_, const std::vector<K>& bounds_,
+		bool node_memory_) : bounds{bounds_}, m{m_}, node_memory{node_memory_} {
+	assert(std::is_sorted(bounds.begin(), bounds.end()));
+	for (size_t i = 0; i <= bounds.size(); i++)
+		shards.emplace_back(new shard(m, node_memory));
+}
+
+template <typename K, typename V>
+size_t bptree_sharded<K,V>::route(const K& key) const noexcept {
+	return std::upper_bound(bounds.begin(), bounds.end(), key) - bounds.begin();
+}
+
+template <typename K, typename V>
+size_t bptree_sharded<K,V>::get_shards() const noexcept {
+	std::shared_lock<std::shared_timed_mutex> rl(router_lock);
+	return shards.size();
+}
+
+template <typename K, typename V>
+uint64_t bptree_sharded<K,V>::get_count() const noexcept {
+	std::shared_lock<std::shared_timed_mutex> rl(router_lock);
+	uint64_t count = 0;
+	for (auto &s : shards) {
+		std::lock_guard<std::mutex> l(s->lock);
+		count += s->tree.get_count();
+	}
+	return count;
+}
+
+/* value is copied out, a pointer into the shard is not safe once the
+ * shard lock is released
+*/
+template <typename K, typename V>
+bool bptree_sharded<K,V>::find_key(const K& key, V& value) const noexcept {
+	std::shared_lock<std::shared_timed_mutex> rl(router_lock);
+	shard* s = shards[route(key)].get();
+	std::lock_guard<std::mutex> l(s->lock);
+	V* v;
+	if (!s->tree.find_key(key, v))
+		return false;
+	value = *v;
+	return true;
+}
+
+template <typename K, typename V>
+void bptree_sharded<K,V>::insert_key(const K& key, const V& value) noexcept {
+	std::shared_lock<std::shared_timed_mutex> rl(router_lock);
+	shard* s = shards[route(key)].get();
+	std::lock_guard<std::mutex> l(s->lock);
+	s->tree.insert_key(key, value);
+}
+
+template <typename K, typename V>
+bool bptree_sharded<K,V>::delete_key(const K& key) noexcept {
+	std::shared_lock<std::shared_timed_mutex> rl(router_lock);
+	shard* s = shards[route(key)].get();
+	std::lock_guard<std::mutex> l(s->lock);
+	return s->tree.delete_key(key);
+}
+
+/* scan [from, to) across shard boundaries. shards are locked one at a time,
+ * so the scan is ordered but not a snapshot of the whole container
+*/
+template <typename K, typename V>
+template <typename F>
+bool bptree_sharded<K,V>::scan_range(const K& from, const K& to, F fn) const {
+	std::shared_lock<std::shared_timed_mutex> rl(router_lock);
+	for (size_t i = route(from); i < shards.size(); i++) {
+		if (i > 0 && !(bounds[i - 1] < to))
+			break;
+		shard* s = shards[i].get();
+		std::lock_guard<std::mutex> l(s->lock);
+		if (!s->tree.scan_range(from, to, fn))
+			return false;
+	}
+	return true;
+}
+
+/* split shard i at its median key, upper half goes to a new shard i+1.
+ * finding the median and split_at both walk the shard's leaves. nodes
+ * cannot change memory, with node memory on the upper half is rebuilt in
+ * the new shard's memory
+*/
+template <typename K, typename V>
+void bptree_sharded<K,V>::split_shard(size_t i) noexcept {
+	bptree<K,V>& t = shards[i]->tree;
+	uint64_t half = t.get_count() / 2, seen = 0;
+	K median;
+
+	if (half == 0)
+		return;
+	t.scan_all([&](const K& k, const V& v) {
+		if (seen++ < half)
+			return true;
+		median = k;
+		return false;
+	});
+
+	shard* ns = new shard(m, node_memory);
+	if (node_memory) {
+		bptree<K,V> upper(m);
+		upper.set_memory(shards[i]->mem.get());
+		t.split_at(median, upper);
+		upper.freeze().thaw(ns->tree);
+	} else {
+		t.split_at(median, ns->tree);
+	}
+	bounds.insert(bounds.begin() + i, median);
+	shards.emplace(shards.begin() + i + 1, ns);
+}
+
+/* fold shard i+1 into shard i and drop the bound between them, with
+ * node memory on shard i+1 is first rebuilt in shard i's memory
+*/
+template <typename K, typename V>
+void bptree_sharded<K,V>::merge_shards(size_t i) noexcept {
+	if (node_memory) {
+		bptree<K,V> upper(m);
+		upper.set_memory(shards[i]->mem.get());
+		shards[i + 1]->tree.freeze().thaw(upper);
+		shards[i]->tree.join(upper);
+	} else {
+		shards[i]->tree.join(shards[i + 1]->tree);
+	}
+	bounds.erase(bounds.begin() + i);
+	shards.erase(shards.begin() + i + 1);
+}
+
+/* bring the container to nshards partitions, then keep splitting the
+ * largest shard (and merging the smallest adjacent pair to hold the shard
+ * count) while it is more than skew times the average
+*/
+template <typename K, typename V>
+void bptree_sharded<K,V>::rebalance(size_t nshards, double skew) noexcept {
+	std::unique_lock<std::shared_timed_mutex> rl(router_lock);
+
+	if (nshards == 0)
+		nshards = 1;
+	for (size_t iter = 0; iter < 4 * nshards; iter++) {
+		uint64_t total = 0;
+		size_t largest = 0, pair = 0;
+		for (size_t i = 0; i < shards.size(); i++) {
+			total += shards[i]->tree.get_count();
+			if (shards[i]->tree.get_count() > shards[largest]->tree.get_count())
+				largest = i;
+			if (i + 1 < shards.size() &&
+				shards[i]->tree.get_count() + shards[i + 1]->tree.get_count() <
+				shards[pair]->tree.get_count() + shards[pair + 1]->tree.get_count())
+				pair = i;
+		}
+
+		if (shards.size() > nshards) {
+			merge_shards(pair);
+			continue;
+		}
+		if (shards[largest]->tree.get_count() < 2)
+			break;
+		if (shards.size() < nshards) {
+			split_shard(largest);
+			continue;
+		}
+		if (shards[largest]->tree.get_count() <= skew * total / nshards)
+			break;
+		split_shard(largest);
+	}
+}
+
+template <typename K, typename V>
+void bptree_sharded<K,V>::dump_brief() const noexcept {
+	std::shared_lock<std::shared_timed_mutex> rl(router_lock);
+	std::cout << "sharded B+ tree, " << shards.size() << " shards:\n";
+	for (size_t i = 0; i < shards.size(); i++) {
+		std::lock_guard<std::mutex> l(shards[i]->lock);
+		std::cout << "\t[" << i << "] ";
+		if (i > 0)
+			std::cout << "from " << bounds[i - 1] << " ";
+		std::cout << "count " << shards[i]->tree.get_count() << "\n";
+	}
+}
+
+#endif
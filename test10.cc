@@ -0,0 +1,90 @@
+#include <iostream>
+#include <cstdlib>
+#include <map>
+#include "bptree.hh"
+#include "bptest.hh"
+
+#define MAXV 50000
+
+/* trees placed in bpnode_memory regions under every policy, and in a
+ * memory whose regions are too large to map so every node falls back to
+ * the heap: the content is checked against std::map, and all memory must
+ * be handed back once the trees are gone
+*/
+
+static void run(bpnode_memory& mem, bool compress) {
+	bptree<long, long> bt(16, compress), right(16, compress);
+	std::map<long, long> ref, rref;
+	unsigned seed = 1;
+
+	bt.set_memory(&mem);
+	right.set_memory(&mem);
+	for (long i = 0; i < MAXV; i++) {
+		long k = rand_r(&seed) % (MAXV * 2);
+		if (rand_r(&seed) % 4) {
+			bt.insert_key(k, i);
+			ref[k] = i;
+		} else {
+			bt.delete_key(k);
+			ref.erase(k);
+		}
+	}
+	verify_scan("tree", bt, ref);
+
+	bt.split_at(MAXV, right);
+	rref.insert(ref.lower_bound(MAXV), ref.end());
+	ref.erase(ref.lower_bound(MAXV), ref.end());
+	verify_scan("tree", bt, ref);
+	verify_scan("right", right, rref);
+	bt.join(right);
+	ref.insert(rref.begin(), rref.end());
+	verify_scan("tree", bt, ref);
+
+	for (long k = 0; k < MAXV; k++) {
+		right.insert_key(k * 2 + 1, -k);
+		ref[k * 2 + 1] = -k;
+	}
+	bt.merge(right);
+	verify_scan("tree", bt, ref);
+
+	bt.set_write_buffer(8);
+	for (long k = 0; k < MAXV * 2; k += 3) {
+		bt.delete_key(k);
+		ref.erase(k);
+	}
+	bt.flush();
+	verify_scan("tree", bt, ref);
+}
+
+int main() {
+	struct {
+		bool huge;
+		size_t region;
+		bpmem_policy policy;
+		const char* name;
+	} cases[] = {
+		/* small regions so the trees span several of them */
+		{ false, 2 << 20, BPMEM_LOCAL, "4k local" },
+		{ true, 2 << 20, BPMEM_LOCAL, "huge local" },
+		{ true, 2 << 20, BPMEM_BIND, "huge bind node 0" },
+		{ true, 2 << 20, BPMEM_INTERLEAVE, "huge interleave node 0" },
+		/* beyond any address space */
+		{ false, 1UL << 60, BPMEM_LOCAL, "heap fallback" },
+	};
+	for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		bpnode_memory mem(cases[i].huge, cases[i].region, cases[i].policy, 1);
+		bool fallback = cases[i].region > (2 << 20);
+		for (int c = 0; c < 2; c++) {
+			run(mem, c);
+			bpmem_stats st = mem.get_stats();
+			if (st.used != 0 || st.heap != 0 || st.reserved < st.huge ||
+					(fallback ? st.regions != 0 : st.regions < 2)) {
+				std::cout << cases[i].name << ": stats err, used " << st.used
+					<< " regions " << st.regions << std::endl;
+				exit(-2);
+			}
+		}
+		std::cout << cases[i].name << " ok" << std::endl;
+	}
+	std::cout << "end." << std::endl;
+}
@@ -0,0 +1,107 @@
+#include <iostream>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <stdexcept>
+#include "bptree_arena.hh"
+#include "bptest.hh"
+
+#define MAXV 50000
+#define MAXK 5000
+
+/* string values out of line: random inserts, overwrites and deletes
+ * checked against std::map, the arena must stay bounded by compaction
+*/
+
+/* claims 4 GiB without holding it, to hit the record length limit */
+struct huge_value {};
+
+template <>
+struct bpvalue_traits<huge_value> {
+	static size_t size(const huge_value& v) noexcept { return 1UL << 32; }
+	static void store(const huge_value& v, char* p) noexcept { abort(); }
+	static void load(const char* p, size_t n, huge_value& v) noexcept {}
+};
+
+static std::string make_value(unsigned& seed, long i) {
+	return std::string(rand_r(&seed) % 200, 'a' + i % 26) + std::to_string(i);
+}
+
+static void verify(bptree_arena<int, std::string>& bt,
+		const std::map<int, std::string>& ref) {
+	bool ok = same_pairs(ref, [&](auto fn) { return bt.scan_range(0, MAXK, fn); });
+	if (!ok || bt.get_count() != ref.size()) {
+		std::cout << "scan err: count " << bt.get_count() << " expect "
+			<< ref.size() << std::endl;
+		exit(-1);
+	}
+	for (int k = 0; k < MAXK; k += 7) {
+		std::string v;
+		auto r = ref.find(k);
+		if (bt.find_key(k, v) != (r != ref.end()) || (r != ref.end() && v != r->second)) {
+			std::cout << "find err: key " << k << std::endl;
+			exit(-2);
+		}
+	}
+	bt.check();
+}
+
+int main() {
+	int ms[] = { 3, 16, 128 };
+	for (int i = 0; i < sizeof(ms) / sizeof(int); i++) {
+		bptree_arena<int, std::string> bt(ms[i]);
+		std::map<int, std::string> ref;
+		unsigned seed = i + 1;
+
+		for (long j = 0; j < MAXV; j++) {
+			int k = rand_r(&seed) % MAXK;
+			if (rand_r(&seed) % 4) {
+				std::string v = make_value(seed, j);
+				bt.insert_key(k, v);
+				ref[k] = v;
+			} else if (bt.delete_key(k) != (ref.erase(k) == 1)) {
+				std::cout << "delete err: key " << k << std::endl;
+				exit(-3);
+			}
+			if (bt.get_dead_bytes() > bt.get_arena_bytes() / 2 + 4096) {
+				std::cout << "compaction err: dead " << bt.get_dead_bytes()
+					<< " of " << bt.get_arena_bytes() << std::endl;
+				exit(-4);
+			}
+		}
+		verify(bt, ref);
+
+		bt.compact();
+		if (bt.get_dead_bytes() != 0) {
+			std::cout << "compact err" << std::endl;
+			exit(-5);
+		}
+		verify(bt, ref);
+		std::cout << "m " << ms[i] << " ok, arena " << bt.get_arena_bytes()
+			<< " bytes" << std::endl;
+	}
+
+	/* fixed size values are copied as they are */
+	bptree_arena<long, double> dt(8);
+	for (long k = 0; k < 1000; k++)
+		dt.insert_key(k, k / 2.0);
+	double d;
+	if (!dt.find_key(501, d) || d != 250.5 || dt.get_arena_bytes() != 1000 * 12) {
+		std::cout << "double err" << std::endl;
+		exit(-6);
+	}
+
+	/* oversized values are refused and leave the tree untouched */
+	bptree_arena<int, huge_value> ht(8);
+	bool thrown = false;
+	try {
+		ht.insert_key(1, huge_value());
+	} catch (const std::length_error&) {
+		thrown = true;
+	}
+	if (!thrown || ht.get_count() != 0 || ht.get_arena_bytes() != 0) {
+		std::cout << "oversize err" << std::endl;
+		exit(-7);
+	}
+	std::cout << "end." << std::endl;
+}
@@ -4,10 +4,22 @@
 #include <cstdlib>
 #include <sys/time.h>
 #include <unordered_set>
+#include <vector>
 #include "bptree.hh"
 
 #define MAXV 100000
 
+/* every write checks the nodes it touched, a slice of the leaves is
+ * checked every SAMPLE writes and the whole tree after each phase
+*/
+#define SAMPLE 10000
+#define STRIDE 16
+
+static void report(const std::string& msg) {
+	std::cout << "check err: " << msg << std::endl;
+	exit(-7);
+}
+
 void one_loop(std::unordered_set<long>& uset, 
 			bptree<int, long>& bt) {
 	long *v;
@@ -35,7 +47,8 @@ void one_loop(std::unordered_set<long>& uset,
 		//	std::cout << "ins skip " << k << std::endl;
 		}
 
-		bt.check();
+		if (i % SAMPLE == 0)
+			bt.check_sampled(report, STRIDE, i / SAMPLE);
 		if (i % 50000 == 1) {
 			bt.dump_brief();
 		//	std::cout << "uset size " << uset.size() << std::endl;
@@ -47,6 +60,26 @@ void one_loop(std::unordered_set<long>& uset,
 		}
 	}
 
+	bt.check();
+
+	std::cout << "---- batch lookup ----\n";
+	std::vector<int> keys(MAXV);
+	std::vector<long*> values(MAXV);
+	for (long i = 0; i < MAXV; i++)
+		keys[i] = i;
+	if (bt.find_many(keys.data(), values.data(), MAXV) != uset.size()) {
+		std::cout << "find_many err: found count mismatch\n";
+		exit(-6);
+	}
+	for (long i = 0; i < MAXV; i++) {
+		bool in_uset = uset.find(i) != uset.end();
+		if ((values[i] != nullptr) != in_uset ||
+			(values[i] != nullptr && *values[i] != i * 2)) {
+			std::cout << "find_many err: key " << i << std::endl;
+			exit(-6);
+		}
+	}
+
 	std::cout << "---- deleting ----\n";
 	for (long i = 0; i < MAXV; i++) {
 		long k = (double)rand() / RAND_MAX * MAXV;
@@ -69,7 +102,8 @@ void one_loop(std::unordered_set<long>& uset,
 		//	std::cout << "del skip " << k << std::endl;
 		}
 
-		bt.check();
+		if (i % SAMPLE == 0)
+			bt.check_sampled(report, STRIDE, i / SAMPLE);
 		if (i % 50000 == 1) {
 			bt.dump_brief();
 		//	std::cout << "uset size " << uset.size() << std::endl;
@@ -80,11 +114,13 @@ void one_loop(std::unordered_set<long>& uset,
 			}
 		}
 	}
+	bt.check();
 }
 
 int main() {
 	std::unordered_set<long> uset;
 	bptree<int, long> bt(128);
+	bt.set_validate(report);
 	for (int i = 0; i < 5000; i++) {
 		std::cout << ">>> loop start " << i << std::endl;
 		one_loop(uset, bt);
@@ -0,0 +1,93 @@
+#include <iostream>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "bptree_shard.hh"
+#include "bptest.hh"
+
+#define MAXV 1000000
+
+static void check_scan(bptree_sharded<long, long>& bt) {
+	long last = -1;
+	uint64_t n = 0;
+	bt.scan_range(0, MAXV, [&](const long& k, const long& v) {
+		if (k <= last || v != k * 2) {
+			std::cout << "scan err: key " << k << " after " << last << "\n";
+			exit(-1);
+		}
+		last = k;
+		n++;
+		return true;
+	});
+	if (n != bt.get_count()) {
+		std::cout << "scan err: scanned " << n << " count "
+			<< bt.get_count() << "\n";
+		exit(-2);
+	}
+}
+
+static void run(int nthreads, bool node_memory) {
+	std::vector<long> bounds;
+	for (int i = 1; i < nthreads * 4; i++)
+		bounds.push_back((long)MAXV * i / (nthreads * 4));
+	bptree_sharded<long, long> bt(64, bounds, node_memory);
+
+	double t0 = now();
+	std::vector<std::thread> threads;
+	for (int t = 0; t < nthreads; t++) {
+		threads.emplace_back([&bt, t, nthreads]() {
+			unsigned seed = t + 1;
+			for (long i = 0; i < MAXV / nthreads; i++) {
+				long k = (double)rand_r(&seed) / RAND_MAX * MAXV;
+				bt.insert_key(k, k * 2);
+			}
+		});
+	}
+	for (auto &th : threads)
+		th.join();
+	double t1 = now();
+
+	std::cout << nthreads << " threads, " << bt.get_shards() << " shards"
+		<< (node_memory ? " in node memory: " : ": ")
+		<< (long)(MAXV / (t1 - t0)) << " inserts/s, count "
+		<< bt.get_count() << std::endl;
+	check_scan(bt);
+}
+
+/* skewed load into a single shard, then rebalance it */
+static void skewed(bool node_memory) {
+	bptree_sharded<long, long> bt(16, std::vector<long>(), node_memory);
+	for (long i = 0; i < MAXV / 10; i++)
+		bt.insert_key(i, i * 2);
+	bt.rebalance(8);
+	bt.dump_brief();
+	if (bt.get_shards() != 8 || bt.get_count() != MAXV / 10) {
+		std::cout << "rebalance err" << std::endl;
+		exit(-3);
+	}
+	check_scan(bt);
+
+	for (long i = 0; i < MAXV / 10; i += 2)
+		bt.delete_key(i);
+	bt.rebalance(4);
+	bt.dump_brief();
+	check_scan(bt);
+
+	long v;
+	if (!bt.find_key(1, v) || v != 2 || bt.find_key(2, v)) {
+		std::cout << "find err" << std::endl;
+		exit(-4);
+	}
+}
+
+int main() {
+	int ncpu = std::thread::hardware_concurrency();
+	if (ncpu < 1)
+		ncpu = 1;
+	for (int c = 0; c < 2; c++) {
+		for (int n = 1; n <= ncpu; n *= 2)
+			run(n, c);
+		skewed(c);
+	}
+	std::cout << "end." << std::endl;
+}
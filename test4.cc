@@ -0,0 +1,96 @@
+#include <iostream>
+#include <cstdlib>
+#include <map>
+#include <vector>
+#include "bptree.hh"
+#include "bptest.hh"
+
+#define MAXV 50000
+
+/* the whole content, and every 7th key through the lookups */
+static void verify(const char* what, bptree<long, long>& bt,
+			const std::map<long, long>& ref) {
+	std::vector<long> keys;
+	long n = 0;
+	for (auto &kv : ref) {
+		if (n++ % 7 == 0)
+			keys.push_back(kv.first);
+	}
+	verify_scan(what, bt, ref);
+	verify_lookups(what, bt, ref, keys);
+}
+
+static void one_loop(int m, unsigned seed) {
+	bptree<long, long> daily(m);
+	std::map<long, long> ref;
+
+	/* fold per-hour trees into the daily one */
+	for (int hour = 0; hour < 24; hour++) {
+		bptree<long, long> hourly(m);
+		for (long i = 0; i < MAXV / 24; i++) {
+			long k = (double)rand_r(&seed) / RAND_MAX * MAXV;
+			hourly.insert_key(k, k + hour);
+			ref[k] = k + hour;
+		}
+		daily.merge(hourly);
+		if (hourly.get_count() != 0) {
+			std::cout << "merge err: other not empty" << std::endl;
+			exit(-2);
+		}
+		verify("merge", daily, ref);
+	}
+	std::cout << "m " << m << " merged ";
+	daily.dump_brief();
+
+	/* split at random points, then join back in both orders */
+	for (int i = 0; i < 20; i++) {
+		long k = (double)rand_r(&seed) / RAND_MAX * (MAXV + 100) - 50;
+		bptree<long, long> right(m);
+		std::map<long, long> rref(ref.lower_bound(k), ref.end());
+		std::map<long, long> lref(ref.begin(), ref.lower_bound(k));
+
+		daily.split_at(k, right);
+		verify("split left", daily, lref);
+		verify("split right", right, rref);
+
+		if (i % 2) {
+			if (!daily.join(right)) {
+				std::cout << "join err" << std::endl;
+				exit(-3);
+			}
+		} else {
+			if (!right.join(daily)) {
+				std::cout << "join err" << std::endl;
+				exit(-3);
+			}
+			daily.join(right);
+		}
+		verify("join", daily, ref);
+
+		/* keep mutating the joined tree */
+		for (int j = 0; j < 100; j++) {
+			long d = (double)rand_r(&seed) / RAND_MAX * MAXV;
+			daily.delete_key(d);
+			ref.erase(d);
+			daily.insert_key(d + 1, d);
+			ref[d + 1] = d;
+		}
+		verify("mutate", daily, ref);
+	}
+
+	bptree<long, long> a(m), b(m);
+	a.insert_key(1, 1);
+	a.insert_key(5, 5);
+	b.insert_key(3, 3);
+	if (a.join(b) || a.get_count() != 2 || b.get_count() != 1) {
+		std::cout << "join overlap err" << std::endl;
+		exit(-4);
+	}
+}
+
+int main() {
+	int ms[] = { 3, 4, 5, 16, 128 };
+	for (int i = 0; i < sizeof(ms) / sizeof(int); i++)
+		one_loop(ms[i], i + 1);
+	std::cout << "end." << std::endl;
+}
@@ -0,0 +1,79 @@
+#include <iostream>
+#include <cstdlib>
+#include <map>
+#include <vector>
+#include "bptree.hh"
+#include "bptest.hh"
+
+#define MAXV 50000
+
+/* compressed leaves: random inserts and deletes checked against std::map,
+ * with an occasional far away key so leaves switch between 1, 2 and 4 byte
+ * offsets or fall back to plain keys
+*/
+
+/* the whole content, and lookups one past every key: hits where keys
+ * are adjacent, misses inside and past the packed ranges elsewhere
+*/
+template <typename K>
+static void verify(const char* what, bptree<K, long>& bt,
+			const std::map<K, long>& ref) {
+	std::vector<K> keys;
+	for (auto &kv : ref)
+		keys.push_back(kv.first + 1);
+	verify_scan(what, bt, ref);
+	verify_lookups(what, bt, ref, keys);
+}
+
+template <typename K>
+static void one_loop(int m, unsigned seed) {
+	bptree<K, long> bt(m, true);
+	std::map<K, long> ref;
+
+	for (long i = 0; i < MAXV; i++) {
+		K k = (double)rand_r(&seed) / RAND_MAX * MAXV;
+		if (i % 1000 == 0)
+			k = (K)((long)rand_r(&seed) * 4096);
+		if (rand_r(&seed) % 3) {
+			bt.insert_key(k, i);
+			ref[k] = i;
+		} else {
+			long* v;
+			if (bt.find_key(k, v) != (ref.find(k) != ref.end())) {
+				std::cout << "find err: " << k << std::endl;
+				exit(-3);
+			}
+			bt.delete_key(k);
+			ref.erase(k);
+		}
+	}
+	verify("insert/delete", bt, ref);
+
+	bptree<K, long> right(m, true);
+	bt.split_at(MAXV / 2, right);
+	verify("split left", bt, std::map<K, long>(ref.begin(), ref.lower_bound(MAXV / 2)));
+	verify("split right", right, std::map<K, long>(ref.lower_bound(MAXV / 2), ref.end()));
+	bt.join(right);
+	verify("join", bt, ref);
+
+	bptree<K, long> other(m);
+	for (long i = 0; i < MAXV; i += 3) {
+		other.insert_key(i, -i);
+		ref[i] = -i;
+	}
+	bt.merge(other);
+	verify("merge", bt, ref);
+
+	std::cout << "m " << m << " ";
+	bt.dump_brief();
+}
+
+int main() {
+	int ms[] = { 4, 5, 16, 128 };
+	for (int i = 0; i < sizeof(ms) / sizeof(int); i++) {
+		one_loop<int>(ms[i], i + 1);
+		one_loop<long>(ms[i], i + 11);
+		one_loop<unsigned short>(ms[i], i + 21);
+	}
+	std::cout << "end." << std::endl;
+}
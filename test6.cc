@@ -0,0 +1,93 @@
+#include <iostream>
+#include <cstdlib>
+#include <map>
+#include <vector>
+#include "bptree_multi.hh"
+#include "bptest.hh"
+
+#define MAXV 50000
+#define MAXK 2000
+
+/* duplicate keys: a few heavy keys and many light ones, checked against
+ * std::multimap
+*/
+
+static void verify(bptree_multi<int, long>& bt, const std::multimap<int, long>& ref) {
+	bool ok = same_pairs(ref, [&](auto fn) { return bt.scan_range(0, MAXK, fn); });
+	if (!ok || bt.get_count() != ref.size()) {
+		std::cout << "scan err: count " << bt.get_count() << " expect "
+			<< ref.size() << std::endl;
+		exit(-1);
+	}
+	for (int k = 0; k < MAXK; k += 7) {
+		if (bt.count_key(k) != ref.count(k)) {
+			std::cout << "count err: key " << k << std::endl;
+			exit(-2);
+		}
+	}
+	bt.check();
+}
+
+int main() {
+	int ms[] = { 4, 32 };
+	for (int i = 0; i < sizeof(ms) / sizeof(int); i++) {
+		bptree_multi<int, long> bt(ms[i]);
+		std::multimap<int, long> ref;
+		unsigned seed = i + 1;
+
+		for (long j = 0; j < MAXV; j++) {
+			/* skewed: key 0..9 get half of all values */
+			int k = (rand_r(&seed) % 2) ? rand_r(&seed) % 10 :
+				rand_r(&seed) % MAXK;
+			long v = rand_r(&seed) % 1000;
+			if (rand_r(&seed) % 4) {
+				bt.insert(k, v);
+				auto r = ref.equal_range(k);
+				auto pos = r.second;
+				for (auto p = r.first; p != r.second; p++) {
+					if (v < p->second) {
+						pos = p;
+						break;
+					}
+				}
+				ref.insert(pos, std::make_pair(k, v));
+			} else {
+				bool found = false;
+				auto r = ref.equal_range(k);
+				for (auto p = r.first; p != r.second; p++) {
+					if (p->second == v) {
+						ref.erase(p);
+						found = true;
+						break;
+					}
+				}
+				if (bt.erase(k, v) != found) {
+					std::cout << "erase err: " << k << " " << v << std::endl;
+					exit(-3);
+				}
+			}
+		}
+		verify(bt, ref);
+
+		long last = -1, n = 0;
+		bt.for_each(3, [&](const long& v) {
+			if (v < last) {
+				std::cout << "posting order err" << std::endl;
+				exit(-4);
+			}
+			last = v;
+			n++;
+			return true;
+		});
+		if (n != ref.count(3) || bt.erase_key(3) != n) {
+			std::cout << "erase_key err" << std::endl;
+			exit(-5);
+		}
+		ref.erase(3);
+		verify(bt, ref);
+
+		std::cout << "m " << ms[i] << ": " << bt.get_keys() << " keys, "
+			<< bt.get_count() << " values, depth " << bt.get_depth() << std::endl;
+	}
+	std::cout << "end." << std::endl;
+}
@@ -0,0 +1,100 @@
+#include <algorithm>
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+#include <strings.h>
+#include "bptree.hh"
+#include "bptest.hh"
+
+#define MAXV 30000
+
+/* string keys with long shared prefixes, prefix keys, custom comparators,
+ * all checked against std::map with the same ordering
+*/
+
+struct nocase_less {
+	bool operator()(const std::string& a, const std::string& b) const {
+		return strcasecmp(a.c_str(), b.c_str()) < 0;
+	}
+};
+
+static std::string make_str(unsigned& seed) {
+	char buf[64];
+	static const char* hosts[] = { "alpha", "Alpha", "beta", "gamma" };
+	int len = snprintf(buf, sizeof(buf), "/srv/data/%s/%05d/%d",
+		hosts[rand_r(&seed) % 4], rand_r(&seed) % 5000, rand_r(&seed) % 4);
+	/* cut to a random prefix so keys share long heads */
+	return std::string(buf, std::min(len, 10 + rand_r(&seed) % 20));
+}
+
+template <typename K, typename C, typename MK>
+static void run(const char* what, int m, MK mk) {
+	bptree<K, long, C> bt(m);
+	std::map<K, long, C> ref;
+	unsigned seed = m;
+
+	auto verify = [&](const char* step, bptree<K, long, C>& t,
+				const std::map<K, long, C>& r) {
+		std::string label = std::string(what) + " " + step;
+		std::vector<K> keys;
+		for (auto &kv : r)
+			keys.push_back(kv.first);
+		verify_scan(label.c_str(), t, r);
+		verify_lookups(label.c_str(), t, r, keys);
+	};
+
+	for (long i = 0; i < MAXV; i++) {
+		K k = mk(seed);
+		if (rand_r(&seed) % 4) {
+			bt.insert_key(k, i);
+			ref[k] = i;
+		} else {
+			if (bt.delete_key(k) != (ref.erase(k) == 1)) {
+				std::cout << what << " delete err" << std::endl;
+				exit(-3);
+			}
+		}
+	}
+	verify("insert/delete", bt, ref);
+
+	K mid = mk(seed);
+	bptree<K, long, C> right(m);
+	bt.split_at(mid, right);
+	verify("split left", bt, std::map<K, long, C>(ref.begin(), ref.lower_bound(mid)));
+	verify("split right", right, std::map<K, long, C>(ref.lower_bound(mid), ref.end()));
+	bt.join(right);
+	verify("join", bt, ref);
+
+	bptree<K, long, C> other(m);
+	for (long i = 0; i < MAXV / 4; i++) {
+		K k = mk(seed);
+		other.insert_key(k, -i);
+		ref[k] = -i;
+	}
+	bt.merge(other);
+	verify("merge", bt, ref);
+
+	std::cout << what << " m " << m << ": ";
+	bt.dump_brief();
+}
+
+int main() {
+	int ms[] = { 4, 7, 64 };
+	for (int i = 0; i < sizeof(ms) / sizeof(int); i++) {
+		run<std::string, std::less<std::string>>("string", ms[i], make_str);
+		run<bpstr_key, std::less<bpstr_key>>("bpstr_key", ms[i],
+			[](unsigned& seed) { return bpstr_key(make_str(seed)); });
+		run<std::string, nocase_less>("nocase", ms[i], make_str);
+		run<int, std::greater<int>>("greater", ms[i],
+			[](unsigned& seed) { return (int)(rand_r(&seed) % 20000) - 10000; });
+	}
+
+	bptree<int, long, std::greater<int>> desc(4, true);
+	for (int i = 0; i < 10; i++)
+		desc.insert_key(i, i);
+	desc.dump_leaf_keys();
+	std::cout << "end." << std::endl;
+}
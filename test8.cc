@@ -0,0 +1,154 @@
+#include <iostream>
+#include <cstdlib>
+#include <map>
+#include <vector>
+#include "bptree_frozen.hh"
+#include "bptest.hh"
+
+#define MAXV 50000
+#define MAXK 20000
+
+/* write buffered mode: random inserts, updates and deletes parked in inner
+ * node buffers, lookups through the buffers and the tree after flush()
+ * checked against std::map
+*/
+
+/* lookups answered through the buffers, every third key of the range */
+static void verify(bptree<int, long>& bt, const std::map<int, long>& ref) {
+	std::vector<int> keys;
+	for (int k = 0; k < MAXK; k += 3)
+		keys.push_back(k);
+	verify_lookups("buffered", bt, ref, keys);
+	/* the shape has to hold while writes are still parked */
+	bt.check();
+}
+
+static void verify_flushed(bptree<int, long>& bt, const std::map<int, long>& ref) {
+	bt.flush();
+	if (bt.get_pending() != 0) {
+		std::cout << "flush err: pending " << bt.get_pending() << std::endl;
+		exit(-3);
+	}
+	verify_scan("flushed", bt, ref);
+}
+
+static void random_writes(bptree<int, long>& bt, std::map<int, long>& ref,
+		unsigned& seed, int lo, int hi, long n) {
+	for (long j = 0; j < n; j++) {
+		int k = lo + rand_r(&seed) % (hi - lo);
+		if (rand_r(&seed) % 4) {
+			bt.insert_key(k, j);
+			ref[k] = j;
+		} else {
+			bt.delete_key(k);
+			ref.erase(k);
+		}
+	}
+}
+
+/* split_at, join, merge and freeze on trees that still hold parked
+ * writes, they have to apply them before reshaping anything
+*/
+static void structural(int m, size_t cap, unsigned seed) {
+	bptree<int, long> bt(m), right(m), other(m);
+	std::map<int, long> ref, rref, oref;
+
+	bt.set_write_buffer(cap);
+	right.set_write_buffer(cap);
+	other.set_write_buffer(cap);
+	for (int round = 0; round < 20; round++) {
+		random_writes(bt, ref, seed, 0, MAXK, 2000);
+		int at = rand_r(&seed) % MAXK;
+		bt.split_at(at, right);
+		rref.insert(ref.lower_bound(at), ref.end());
+		ref.erase(ref.lower_bound(at), ref.end());
+		verify_flushed(right, rref);
+
+		/* park writes on both sides of the cut, then glue them back */
+		if (at > 0)
+			random_writes(bt, ref, seed, 0, at, 500);
+		random_writes(right, rref, seed, at, MAXK, 500);
+		if (!bt.join(right)) {
+			std::cout << "join err: round " << round << std::endl;
+			exit(-6);
+		}
+		ref.insert(rref.begin(), rref.end());
+		rref.clear();
+		verify(bt, ref);
+
+		random_writes(other, oref, seed, 0, MAXK, 1000);
+		random_writes(bt, ref, seed, 0, MAXK, 200);
+		bt.merge(other);
+		for (auto &kv : oref)
+			ref[kv.first] = kv.second;
+		oref.clear();
+		verify(bt, ref);
+
+		random_writes(bt, ref, seed, 0, MAXK, 200);
+		bptree_frozen<int, long> fr = bt.freeze();
+		if (fr.get_count() != ref.size()) {
+			std::cout << "freeze err: count " << fr.get_count() << std::endl;
+			exit(-7);
+		}
+		verify_flushed(bt, ref);
+	}
+}
+
+int main() {
+	int ms[] = { 3, 4, 5, 16, 64 };
+	size_t caps[] = { 1, 4, 32, 256 };
+	for (int i = 0; i < sizeof(ms) / sizeof(int); i++) {
+		for (int c = 0; c < sizeof(caps) / sizeof(size_t); c++) {
+			bptree<int, long> bt(ms[i]);
+			std::map<int, long> ref;
+			unsigned seed = i * 7 + c + 1;
+
+			bt.set_write_buffer(caps[c]);
+			for (long j = 0; j < MAXV; j++) {
+				int k = rand_r(&seed) % MAXK;
+				/* a delete heavy phase in the middle shrinks the tree */
+				int del = (j > MAXV / 3 && j < MAXV * 2 / 3) ? 3 : 5;
+				if (rand_r(&seed) % 8 < del) {
+					bt.insert_key(k, j);
+					ref[k] = j;
+				} else {
+					bt.delete_key(k);
+					ref.erase(k);
+				}
+				if (j % 5000 == 0)
+					verify(bt, ref);
+			}
+			verify(bt, ref);
+			verify_flushed(bt, ref);
+
+			/* drain down to nothing through the buffers */
+			for (int k = 0; k < MAXK; k++) {
+				bt.delete_key(k);
+				ref.erase(k);
+			}
+			verify(bt, ref);
+			verify_flushed(bt, ref);
+			std::cout << "m " << ms[i] << " cap " << caps[c] << " ok" << std::endl;
+		}
+	}
+
+	for (int i = 0; i < sizeof(ms) / sizeof(int); i++) {
+		for (int c = 0; c < sizeof(caps) / sizeof(size_t); c++)
+			structural(ms[i], caps[c], i * 7 + c + 100);
+		std::cout << "m " << ms[i] << " structural ok" << std::endl;
+	}
+
+	/* switching off applies what is parked */
+	bptree<int, long> bt(8);
+	bt.set_write_buffer(16);
+	for (int k = 0; k < 1000; k++)
+		bt.insert_key(k, k);
+	bt.set_write_buffer(0);
+	if (bt.get_pending() != 0 || bt.get_count() != 1000 || !bt.delete_key(5) ||
+			bt.delete_key(5)) {
+		std::cout << "switch off err" << std::endl;
+		exit(-5);
+	}
+	bt.check();
+	std::cout << "end." << std::endl;
+}
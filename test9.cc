@@ -0,0 +1,123 @@
+#include <iostream>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include "bptree_frozen.hh"
+
+#define MAXV 50000
+
+/* freeze trees of many sizes and shapes, check point lookups, lower_bound
+ * and range scans against std::map, then thaw back and keep writing
+*/
+
+template <typename C>
+static void verify(const bptree_frozen<int, long, C>& fr,
+		const std::map<int, long, C>& ref, int lo, int hi, int from, int to) {
+	if (fr.get_count() != ref.size()) {
+		std::cout << "count err: " << fr.get_count() << " expect "
+			<< ref.size() << std::endl;
+		exit(-1);
+	}
+	for (int k = lo; k <= hi; k++) {
+		const long* v;
+		auto it = ref.lower_bound(k);
+		size_t i = fr.lower_bound(k);
+		if ((it == ref.end()) != (i == fr.get_count()) ||
+				(it != ref.end() && fr.key_at(i) != it->first)) {
+			std::cout << "lower_bound err: key " << k << std::endl;
+			exit(-2);
+		}
+		bool found = fr.find_key(k, v);
+		if (found != (it != ref.end() && it->first == k) ||
+				(found && *v != it->second)) {
+			std::cout << "find err: key " << k << std::endl;
+			exit(-3);
+		}
+	}
+
+	auto it = ref.lower_bound(from);
+	auto end = ref.lower_bound(to);
+	fr.scan_range(from, to, [&](const int& k, const long& v) {
+		if (it == end || it->first != k || it->second != v) {
+			std::cout << "scan err: key " << k << std::endl;
+			exit(-4);
+		}
+		it++;
+		return true;
+	});
+	if (it != end) {
+		std::cout << "scan err: stopped early" << std::endl;
+		exit(-5);
+	}
+}
+
+int main() {
+	size_t sizes[] = { 0, 1, 2, 15, 16, 17, 300, 4913, MAXV };
+	for (int i = 0; i < sizeof(sizes) / sizeof(size_t); i++) {
+		bptree<int, long> bt(5);
+		std::map<int, long> ref;
+		unsigned seed = i + 1;
+
+		while (ref.size() < sizes[i]) {
+			int k = rand_r(&seed) % (MAXV * 4);
+			bt.insert_key(k, k * 3);
+			ref[k] = k * 3;
+		}
+		bptree_frozen<int, long> fr = bt.freeze();
+		verify(fr, ref, -1, MAXV * 4 + 1, MAXV / 3, MAXV * 3);
+
+		bptree<int, long> back(16);
+		fr.thaw(back);
+		back.check();
+		for (int k = 0; k < MAXV; k += 2) {
+			back.delete_key(k);
+			ref.erase(k);
+		}
+		back.check();
+		verify(back.freeze(), ref, -1, MAXV * 4 + 1, MAXV / 3, MAXV * 3);
+		std::cout << "size " << sizes[i] << " depth " << fr.get_depth()
+			<< " ok" << std::endl;
+	}
+
+	/* reversed order through the comparator */
+	bptree<int, long, std::greater<int>> bt(4);
+	std::map<int, long, std::greater<int>> ref;
+	for (int k = 0; k < 1000; k++) {
+		bt.insert_key(k, k);
+		ref[k] = k;
+	}
+	verify(bt.freeze(), ref, -1, 1001, 900, 100);
+
+	/* packed leaves freeze and thaw through their decoded keys */
+	bptree<int, long> cbt(32, true);
+	for (int k = 0; k < MAXV; k++)
+		cbt.insert_key(k * 2, k);
+	bptree_frozen<int, long> cfr = cbt.freeze();
+	bptree<int, long> cback(32, true);
+	cfr.thaw(cback);
+	cback.check();
+	long* v;
+	if (cback.get_count() != MAXV || !cback.find_key(MAXV, v) || *v != MAXV / 2) {
+		std::cout << "thaw err" << std::endl;
+		exit(-6);
+	}
+
+	/* parked writes of a buffered tree are part of the frozen index */
+	bptree<int, long> wbt(8);
+	std::map<int, long> wref;
+	wbt.set_write_buffer(64);
+	for (int k = 0; k < MAXV; k++) {
+		wbt.insert_key(k % 3000, k);
+		wref[k % 3000] = k;
+		if (k % 7 == 0) {
+			wbt.delete_key(k % 2000);
+			wref.erase(k % 2000);
+		}
+	}
+	if (wbt.get_pending() == 0) {
+		std::cout << "buffer err: nothing parked" << std::endl;
+		exit(-7);
+	}
+	verify(wbt.freeze(), wref, -1, 3001, 100, 2500);
+	std::cout << "end." << std::endl;
+}